@@ -21,6 +21,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 LOCAL_MODULE:= libgatekeeper
 LOCAL_SRC_FILES := \
+	failure_record_cache.cpp \
+	gatekeeper_compact_messages.cpp \
 	gatekeeper_messages.cpp \
 	gatekeeper.cpp
 LOCAL_C_INCLUDES := \
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gatekeeper/failure_record_cache.h>
+
+#include <string.h>
+
+// Number of journal entries, as a multiple of the capacity, before compacting
+#define JOURNAL_COMPACT_FACTOR 4
+
+namespace gatekeeper {
+
+static uint32_t journal_checksum(const failure_record_journal_entry_t *entry) {
+    // FNV-1a over everything but the checksum itself
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(entry);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(*entry) - sizeof(entry->checksum); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void make_empty_record(secure_id_t user_id, failure_record_t *record) {
+    memset(record, 0, sizeof(*record));
+    record->secure_user_id = user_id;
+}
+
+/*
+ * An empty record reads the same as no record, whatever its user_id.
+ */
+static bool is_empty_record(const failure_record_t *record) {
+    return record->failure_counter == 0 && record->last_checked_timestamp == 0;
+}
+
+/*
+ * A record must be persisted before it is acknowledged if losing it would
+ * leave storage with a lower failure count for the same user.
+ */
+static bool raises_failure_count(const failure_record_t *persisted,
+        const failure_record_t *record) {
+    uint32_t persisted_counter = persisted->secure_user_id == record->secure_user_id
+            ? persisted->failure_counter : 0;
+    return record->failure_counter > persisted_counter;
+}
+
+FailureRecordCache::FailureRecordCache(FailureRecordJournal *journal, uint32_t capacity)
+        : journal_(journal), entries_(new entry_t[capacity]), capacity_(capacity),
+          journal_length_(0) {
+    memset(entries_.get(), 0, sizeof(entry_t) * capacity);
+}
+
+FailureRecordCache::~FailureRecordCache() {}
+
+bool FailureRecordCache::Load() {
+    memset(entries_.get(), 0, sizeof(entry_t) * capacity_);
+
+    failure_record_journal_entry_t journal_entry;
+    uint32_t index = 0;
+    bool torn = false;
+    while (journal_->Read(index, &journal_entry)) {
+        if (journal_entry.checksum != journal_checksum(&journal_entry)) {
+            torn = true;
+            break;
+        }
+
+        // compacting would rewrite the journal being replayed, so don't reclaim
+        entry_t *entry = Find(journal_entry.uid);
+        if (entry == NULL) entry = Insert(journal_entry.uid);
+        if (entry == NULL) return false;
+        entry->record = journal_entry.record;
+        entry->persisted = journal_entry.record;
+        ReleaseIfEmpty(entry);
+        index++;
+    }
+    journal_length_ = index;
+
+    // anything appended after a torn entry would never be replayed
+    if (torn) return Compact();
+    return true;
+}
+
+bool FailureRecordCache::Get(uint32_t uid, secure_id_t user_id, failure_record_t *record) {
+    entry_t *entry = Find(uid);
+    if (entry == NULL || entry->record.secure_user_id != user_id) {
+        make_empty_record(user_id, record);
+    } else {
+        *record = entry->record;
+    }
+    return true;
+}
+
+bool FailureRecordCache::Write(uint32_t uid, const failure_record_t *record) {
+    entry_t *entry = FindOrInsert(uid);
+    if (entry == NULL) return false;
+
+    if (raises_failure_count(&entry->persisted, record)) {
+        failure_record_t previous = entry->record;
+        entry->record = *record;
+        if (!Persist(entry)) {
+            entry->record = previous;
+            return false;
+        }
+        return true;
+    }
+
+    entry->record = *record;
+    entry->dirty = memcmp(&entry->record, &entry->persisted, sizeof(entry->record)) != 0;
+    ReleaseIfEmpty(entry);
+    return true;
+}
+
+bool FailureRecordCache::Clear(uint32_t uid, secure_id_t user_id) {
+    // nothing stored already reads as an empty record
+    if (Find(uid) == NULL) return true;
+
+    failure_record_t record;
+    make_empty_record(user_id, &record);
+    return Write(uid, &record);
+}
+
+bool FailureRecordCache::Flush() {
+    for (uint32_t i = 0; i < capacity_; i++) {
+        entry_t *entry = &entries_[i];
+        if (entry->in_use && entry->dirty) {
+            if (!Persist(entry)) return false;
+            ReleaseIfEmpty(entry);
+        }
+    }
+    return true;
+}
+
+FailureRecordCache::entry_t *FailureRecordCache::Find(uint32_t uid) {
+    for (uint32_t i = 0; i < capacity_; i++) {
+        if (entries_[i].in_use && entries_[i].uid == uid) return &entries_[i];
+    }
+    return NULL;
+}
+
+FailureRecordCache::entry_t *FailureRecordCache::Insert(uint32_t uid) {
+    for (uint32_t i = 0; i < capacity_; i++) {
+        if (!entries_[i].in_use) {
+            entry_t *entry = &entries_[i];
+            memset(entry, 0, sizeof(*entry));
+            entry->in_use = true;
+            entry->uid = uid;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+FailureRecordCache::entry_t *FailureRecordCache::FindOrInsert(uint32_t uid) {
+    entry_t *entry = Find(uid);
+    if (entry != NULL) return entry;
+
+    entry = Insert(uid);
+    if (entry != NULL) return entry;
+
+    // compaction persists pending clears, freeing their slots
+    if (!Compact()) return NULL;
+    return Insert(uid);
+}
+
+/*
+ * Frees the slot of an empty record once the journal agrees it is empty,
+ * so that neither a reboot nor a later insert can bring back a failure.
+ */
+void FailureRecordCache::ReleaseIfEmpty(entry_t *entry) {
+    if (is_empty_record(&entry->record) && is_empty_record(&entry->persisted)) {
+        memset(entry, 0, sizeof(*entry));
+    }
+}
+
+bool FailureRecordCache::Persist(entry_t *entry) {
+    failure_record_journal_entry_t journal_entry;
+    journal_entry.uid = entry->uid;
+    journal_entry.record = entry->record;
+    journal_entry.checksum = journal_checksum(&journal_entry);
+    if (!journal_->Append(&journal_entry)) return false;
+
+    journal_length_++;
+    entry->persisted = entry->record;
+    entry->dirty = false;
+
+    // the entry is durable either way, a failed compaction is retried next time
+    if (journal_length_ >= capacity_ * JOURNAL_COMPACT_FACTOR) Compact();
+    return true;
+}
+
+bool FailureRecordCache::Compact() {
+    // empty records are left out, replaying nothing for a uid reads the same
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < capacity_; i++) {
+        if (entries_[i].in_use && !is_empty_record(&entries_[i].record)) count++;
+    }
+
+    UniquePtr<failure_record_journal_entry_t[]> snapshot(
+            new failure_record_journal_entry_t[count > 0 ? count : 1]);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < capacity_; i++) {
+        if (!entries_[i].in_use || is_empty_record(&entries_[i].record)) continue;
+        snapshot[n].uid = entries_[i].uid;
+        snapshot[n].record = entries_[i].record;
+        snapshot[n].checksum = journal_checksum(&snapshot[n]);
+        n++;
+    }
+
+    if (!journal_->Rewrite(snapshot.get(), count)) return false;
+
+    journal_length_ = count;
+    for (uint32_t i = 0; i < capacity_; i++) {
+        entries_[i].persisted = entries_[i].record;
+        entries_[i].dirty = false;
+        if (entries_[i].in_use) ReleaseIfEmpty(&entries_[i]);
+    }
+    return true;
+}
+
+}
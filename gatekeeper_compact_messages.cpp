@@ -0,0 +1,151 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <gatekeeper/gatekeeper_compact_messages.h>
+
+#include <string.h>
+
+namespace gatekeeper {
+
+/**
+ * Copies from into to, inline if it fits and into the heap otherwise.
+ */
+template <uint32_t Capacity>
+static inline void compact_buffer(const SizedBuffer &from, compact_buffer_t<Capacity> *to) {
+    to->Clear();
+    if (from.length > Capacity) {
+        to->overflow.Allocate(from.length, NULL);
+        memcpy(to->overflow.MutableData(), from.Data(), from.length);
+    } else if (from.length != 0) {
+        memcpy(to->data, from.Data(), from.length);
+    }
+    to->length = from.length;
+}
+
+/**
+ * Makes to a view of the contents of from. A length that doesn't match
+ * where they are stored means the compact struct was corrupted.
+ */
+template <uint32_t Capacity>
+static inline bool expand_buffer(const compact_buffer_t<Capacity> &from, SizedBuffer *to) {
+    if (from.length == 0) {
+        to->Clear();
+        return true;
+    }
+
+    const uint8_t *data = from.data;
+    if (from.length > Capacity) {
+        if (from.overflow.length != from.length) return false;
+        data = from.overflow.Data();
+    }
+    to->SetView(data, from.length);
+    return true;
+}
+
+template <typename Message>
+static inline gatekeeper_error_t expand_failed(Message *message) {
+    message->Reset();
+    return ERROR_INVALID;
+}
+
+gatekeeper_error_t CompactMessage(const EnrollRequest &message,
+        compact_enroll_request_t *compact) {
+    compact->user_id = message.user_id;
+    compact_buffer(message.password_handle, &compact->password_handle);
+    compact_buffer(message.enrolled_password, &compact->enrolled_password);
+    compact_buffer(message.provided_password, &compact->provided_password);
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t CompactMessage(const EnrollResponse &message,
+        compact_enroll_response_t *compact) {
+    compact->error = message.error;
+    compact->user_id = message.user_id;
+    compact->retry_timeout = message.retry_timeout;
+    compact_buffer(message.enrolled_password_handle, &compact->enrolled_password_handle);
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t CompactMessage(const VerifyRequest &message,
+        compact_verify_request_t *compact) {
+    compact->challenge = message.challenge;
+    compact->user_id = message.user_id;
+    compact_buffer(message.password_handle, &compact->password_handle);
+    compact_buffer(message.provided_password, &compact->provided_password);
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t CompactMessage(const VerifyResponse &message,
+        compact_verify_response_t *compact) {
+    compact->error = message.error;
+    compact->user_id = message.user_id;
+    compact->retry_timeout = message.retry_timeout;
+    compact->request_reenroll = message.request_reenroll;
+    compact_buffer(message.auth_token, &compact->auth_token);
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t ExpandMessage(const compact_enroll_request_t &compact,
+        EnrollRequest *message) {
+    message->Reset();
+    message->user_id = compact.user_id;
+    if (!expand_buffer(compact.password_handle, &message->password_handle)
+            || !expand_buffer(compact.enrolled_password, &message->enrolled_password)
+            || !expand_buffer(compact.provided_password, &message->provided_password)) {
+        return expand_failed(message);
+    }
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t ExpandMessage(const compact_enroll_response_t &compact,
+        EnrollResponse *message) {
+    message->Reset();
+    message->error = wire_error(compact.error);
+    message->user_id = compact.user_id;
+    message->retry_timeout = compact.retry_timeout;
+    if (!expand_buffer(compact.enrolled_password_handle, &message->enrolled_password_handle)) {
+        return expand_failed(message);
+    }
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t ExpandMessage(const compact_verify_request_t &compact,
+        VerifyRequest *message) {
+    message->Reset();
+    message->challenge = compact.challenge;
+    message->user_id = compact.user_id;
+    if (!expand_buffer(compact.password_handle, &message->password_handle)
+            || !expand_buffer(compact.provided_password, &message->provided_password)) {
+        return expand_failed(message);
+    }
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t ExpandMessage(const compact_verify_response_t &compact,
+        VerifyResponse *message) {
+    message->Reset();
+    message->error = wire_error(compact.error);
+    message->user_id = compact.user_id;
+    message->retry_timeout = compact.retry_timeout;
+    message->request_reenroll = compact.request_reenroll != 0;
+    if (!expand_buffer(compact.auth_token, &message->auth_token)) {
+        return expand_failed(message);
+    }
+    return ERROR_NONE;
+}
+
+}
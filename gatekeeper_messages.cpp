@@ -32,6 +32,13 @@ struct __attribute__((__packed__)) serial_header_t {
     uint32_t user_id;
 };
 
+/**
+ * True if at least size bytes are left between payload and end.
+ */
+static inline bool remaining_at_least(const uint8_t *payload, const uint8_t *end, size_t size) {
+    return payload != NULL && payload <= end && static_cast<size_t>(end - payload) >= size;
+}
+
 static inline uint32_t serialized_buffer_size(const SizedBuffer &buf) {
     return sizeof(buf.length) + buf.length;
 }
@@ -40,29 +47,39 @@ static inline void append_to_buffer(uint8_t **buffer, const SizedBuffer *to_appe
     memcpy(*buffer, &to_append->length, sizeof(to_append->length));
     *buffer += sizeof(to_append->length);
     if (to_append->length != 0) {
-        memcpy(*buffer, to_append->buffer.get(), to_append->length);
+        memcpy(*buffer, to_append->Data(), to_append->length);
         *buffer += to_append->length;
     }
 }
 
+/**
+ * Reads a length-prefixed buffer into target. If borrow is true, target is
+ * left as a view into the payload rather than a copy. Copies are made in
+ * arena if it is not NULL.
+ */
 static inline gatekeeper_error_t read_from_buffer(const uint8_t **buffer, const uint8_t *end,
-        SizedBuffer *target) {
-    if (*buffer + sizeof(target->length) > end) return ERROR_INVALID;
-
-    memcpy(&target->length, *buffer, sizeof(target->length));
-    *buffer += sizeof(target->length);
-    if (target->length != 0) {
-        const uint8_t *buffer_end = *buffer + target->length;
-        if (buffer_end > end || buffer_end <= *buffer) return ERROR_INVALID;
-
-        target->buffer.reset(new uint8_t[target->length]);
-        memcpy(target->buffer.get(), *buffer, target->length);
-        *buffer += target->length;
+        SizedBuffer *target, bool borrow, Arena *arena) {
+    target->Clear();
+    uint32_t length;
+    // Bounds are compared as sizes, pointers past end are never formed
+    if (!remaining_at_least(*buffer, end, sizeof(length))) return ERROR_INVALID;
+
+    memcpy(&length, *buffer, sizeof(length));
+    *buffer += sizeof(length);
+    if (length != 0) {
+        if (!remaining_at_least(*buffer, end, length)) return ERROR_INVALID;
+
+        if (borrow) {
+            target->SetView(*buffer, length);
+        } else {
+            target->Allocate(length, arena);
+            memcpy(target->MutableData(), *buffer, length);
+        }
+        *buffer += length;
     }
     return ERROR_NONE;
 }
 
-
 uint32_t GateKeeperMessage::GetSerializedSize() const {
     if (error == ERROR_NONE) {
         uint32_t size = sizeof(serial_header_t) + nonErrorSerializedSize();
@@ -77,46 +94,45 @@ uint32_t GateKeeperMessage::GetSerializedSize() const {
 }
 
 uint32_t GateKeeperMessage::Serialize(uint8_t *buffer, const uint8_t *end) const {
-    uint32_t bytes_written = 0;
-    if (buffer + GetSerializedSize() > end) {
-        return 0;
-    }
+    if (buffer == NULL || end < buffer) return 0;
+
+    // No message is anywhere near 4GB, so a larger buffer is as good as UINT32_MAX
+    size_t available = static_cast<size_t>(end - buffer);
+    uint32_t capacity = available > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(available);
+    uint32_t size = SerializeInto(buffer, capacity);
+    return size <= capacity ? size : 0;
+}
+
+uint32_t GateKeeperMessage::SerializeInto(uint8_t *buffer, uint32_t capacity) const {
+    uint32_t size = GetSerializedSize();
+    if (buffer == NULL || size > capacity) return size;
 
     serial_header_t *header = reinterpret_cast<serial_header_t *>(buffer);
-    if (error != ERROR_NONE) {
-        if (buffer + sizeof(serial_header_t) > end) return 0;
-        header->error = error;
-        header->user_id = user_id;
-        bytes_written += sizeof(*header);
-        if (error == ERROR_RETRY) {
-            memcpy(buffer + sizeof(serial_header_t), &retry_timeout, sizeof(retry_timeout));
-            bytes_written  += sizeof(retry_timeout);
-        }
-    } else {
-        if (buffer + sizeof(serial_header_t) + nonErrorSerializedSize() > end)
-            return 0;
-        header->error = error;
-        header->user_id = user_id;
+    header->error = error;
+    header->user_id = user_id;
+    if (error == ERROR_NONE) {
         nonErrorSerialize(buffer + sizeof(*header));
-        bytes_written += sizeof(*header) + nonErrorSerializedSize();
+    } else if (error == ERROR_RETRY) {
+        memcpy(buffer + sizeof(*header), &retry_timeout, sizeof(retry_timeout));
     }
 
-    return bytes_written;
+    return size;
 }
 
 gatekeeper_error_t GateKeeperMessage::Deserialize(const uint8_t *payload, const uint8_t *end) {
-    if (payload + sizeof(uint32_t) > end) return ERROR_INVALID;
-    const serial_header_t *header = reinterpret_cast<const serial_header_t *>(payload);
-    if (header->error == ERROR_NONE) {
-        if (payload == end) return ERROR_INVALID;
-        user_id = header->user_id;
-        error = nonErrorDeserialize(payload + sizeof(*header), end);
+    serial_header_t header;
+    if (!remaining_at_least(payload, end, sizeof(header))) return ERROR_INVALID;
+    memcpy(&header, payload, sizeof(header));
+    payload += sizeof(header);
+
+    user_id = header.user_id;
+    if (header.error == ERROR_NONE) {
+        error = nonErrorDeserialize(payload, end);
     } else {
-        error = static_cast<gatekeeper_error_t>(header->error);
-        user_id = header->user_id;
+        error = wire_error(header.error);
         if (error == ERROR_RETRY) {
-            if (payload + sizeof(serial_header_t) < end) {
-                memcpy(&retry_timeout, payload + sizeof(serial_header_t), sizeof(retry_timeout));
+            if (remaining_at_least(payload, end, sizeof(retry_timeout))) {
+                memcpy(&retry_timeout, payload, sizeof(retry_timeout));
             } else {
                 retry_timeout = 0;
             }
@@ -126,6 +142,164 @@ gatekeeper_error_t GateKeeperMessage::Deserialize(const uint8_t *payload, const
     return error;
 }
 
+gatekeeper_error_t GateKeeperMessage::DeserializeView(const uint8_t *payload,
+        const uint8_t *end) {
+    borrow_buffers = true;
+    gatekeeper_error_t ret = Deserialize(payload, end);
+    borrow_buffers = false;
+    return ret;
+}
+
+/**
+ * Framed wire format
+ */
+
+static inline uint64_t frame_align(uint64_t size) {
+    return (size + GATEKEEPER_FRAME_ALIGNMENT - 1) & ~((uint64_t) GATEKEEPER_FRAME_ALIGNMENT - 1);
+}
+
+/**
+ * Replaces the contents of target with length bytes at data, as a view if
+ * borrow is true, otherwise as a copy made in arena if it is not NULL.
+ */
+static inline void load_buffer(SizedBuffer *target, const uint8_t *data, uint32_t length,
+        bool borrow, Arena *arena) {
+    target->Clear();
+    if (length == 0) return;
+
+    if (borrow) {
+        target->SetView(data, length);
+    } else {
+        target->Allocate(length, arena);
+        memcpy(target->MutableData(), data, length);
+    }
+}
+
+uint32_t GateKeeperMessage::GetFrameSize() const {
+    uint64_t size = sizeof(gatekeeper_frame_header_t);
+    if (error != ERROR_NONE) return size;
+
+    SizedBuffer *buffers[GATEKEEPER_FRAME_MAX_BUFFERS];
+    uint32_t count = const_cast<GateKeeperMessage *>(this)->frameBuffers(buffers);
+    size += frame_align(nonErrorFrameFixedSize()) + frame_align(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        size += frame_align(buffers[i]->length);
+    }
+    return size;
+}
+
+uint32_t GateKeeperMessage::SerializeFrame(uint8_t *payload, uint32_t capacity) const {
+    uint32_t size = GetFrameSize();
+    if (payload == NULL || size > capacity) return size;
+
+    gatekeeper_frame_header_t *header = reinterpret_cast<gatekeeper_frame_header_t *>(payload);
+    header->version = GATEKEEPER_FRAME_VERSION;
+    header->type = GetFrameType();
+    header->length = size;
+    header->error = error;
+    header->user_id = user_id;
+    header->retry_timeout = error == ERROR_RETRY ? retry_timeout : 0;
+    if (error != ERROR_NONE) return size;
+
+    // Padding is zeroed so that frames never carry stale memory
+    uint8_t *fixed = payload + sizeof(*header);
+    uint32_t fixed_size = frame_align(nonErrorFrameFixedSize());
+    memset(fixed, 0, fixed_size);
+    nonErrorFrameSerialize(fixed);
+
+    SizedBuffer *buffers[GATEKEEPER_FRAME_MAX_BUFFERS];
+    uint32_t count = const_cast<GateKeeperMessage *>(this)->frameBuffers(buffers);
+    uint32_t *lengths = reinterpret_cast<uint32_t *>(fixed + fixed_size);
+    uint32_t lengths_size = frame_align(count * sizeof(uint32_t));
+    memset(lengths, 0, lengths_size);
+
+    uint8_t *data = fixed + fixed_size + lengths_size;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length = buffers[i]->length;
+        uint32_t padded = frame_align(length);
+        lengths[i] = length;
+        if (length != 0) memcpy(data, buffers[i]->Data(), length);
+        memset(data + length, 0, padded - length);
+        data += padded;
+    }
+    return size;
+}
+
+bool GateKeeperMessage::PeekFrameHeader(const uint8_t *payload, uint32_t length,
+        const gatekeeper_frame_header_t **header) {
+    if (payload == NULL || header == NULL) return false;
+    if (reinterpret_cast<uintptr_t>(payload) % GATEKEEPER_FRAME_ALIGNMENT != 0) return false;
+    if (length < sizeof(gatekeeper_frame_header_t)) return false;
+
+    const gatekeeper_frame_header_t *frame =
+            reinterpret_cast<const gatekeeper_frame_header_t *>(payload);
+    if (frame->version != GATEKEEPER_FRAME_VERSION) return false;
+    if (frame->length < sizeof(*frame) || frame->length > length) return false;
+    if (frame->length % GATEKEEPER_FRAME_ALIGNMENT != 0) return false;
+
+    *header = frame;
+    return true;
+}
+
+gatekeeper_error_t GateKeeperMessage::DeserializeFrame(const uint8_t *payload, uint32_t length) {
+    const gatekeeper_frame_header_t *header;
+    if (!PeekFrameHeader(payload, length, &header)) return ERROR_INVALID;
+    if (header->type != GetFrameType()) return ERROR_INVALID;
+
+    SizedBuffer *buffers[GATEKEEPER_FRAME_MAX_BUFFERS];
+    uint32_t count = frameBuffers(buffers);
+    uint64_t fixed_size = frame_align(nonErrorFrameFixedSize());
+    uint64_t lengths_size = frame_align(count * sizeof(uint32_t));
+    const uint8_t *fixed = payload + sizeof(*header);
+    const uint32_t *lengths = reinterpret_cast<const uint32_t *>(fixed + fixed_size);
+
+    // The one validation pass: all reads below are then known to be in bounds
+    if (header->error == ERROR_NONE) {
+        uint64_t expected = sizeof(*header) + fixed_size + lengths_size;
+        if (expected > header->length) return ERROR_INVALID;
+        for (uint32_t i = 0; i < count; i++) {
+            expected += frame_align(lengths[i]);
+        }
+        if (expected != header->length) return ERROR_INVALID;
+    }
+
+    user_id = header->user_id;
+    error = wire_error(header->error);
+    if (error != ERROR_NONE) {
+        retry_timeout = error == ERROR_RETRY ? header->retry_timeout : 0;
+        return error;
+    }
+
+    nonErrorFrameDeserialize(fixed);
+    const uint8_t *data = fixed + fixed_size + lengths_size;
+    for (uint32_t i = 0; i < count; i++) {
+        load_buffer(buffers[i], data, lengths[i], borrow_buffers, arena);
+        data += frame_align(lengths[i]);
+    }
+    return ERROR_NONE;
+}
+
+gatekeeper_error_t GateKeeperMessage::DeserializeFrameView(const uint8_t *payload,
+        uint32_t length) {
+    borrow_buffers = true;
+    gatekeeper_error_t ret = DeserializeFrame(payload, length);
+    borrow_buffers = false;
+    return ret;
+}
+
+void GateKeeperMessage::Reset() {
+    error = ERROR_NONE;
+    user_id = 0;
+    retry_timeout = 0;
+
+    SizedBuffer *buffers[GATEKEEPER_FRAME_MAX_BUFFERS];
+    uint32_t count = frameBuffers(buffers);
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i]->Clear();
+    }
+    nonErrorReset();
+}
+
 void GateKeeperMessage::SetRetryTimeout(uint32_t retry_timeout) {
     this->retry_timeout = retry_timeout;
     this->error = ERROR_RETRY;
@@ -135,10 +309,8 @@ VerifyRequest::VerifyRequest(uint32_t user_id, uint64_t challenge,
         SizedBuffer *enrolled_password_handle, SizedBuffer *provided_password_payload) {
     this->user_id = user_id;
     this->challenge = challenge;
-    this->password_handle.buffer.reset(enrolled_password_handle->buffer.release());
-    this->password_handle.length = enrolled_password_handle->length;
-    this->provided_password.buffer.reset(provided_password_payload->buffer.release());
-    this->provided_password.length = provided_password_payload->length;
+    this->password_handle.Take(enrolled_password_handle);
+    this->provided_password.Take(provided_password_payload);
 }
 
 VerifyRequest::VerifyRequest() {
@@ -147,14 +319,8 @@ VerifyRequest::VerifyRequest() {
 }
 
 VerifyRequest::~VerifyRequest() {
-    if (password_handle.buffer.get()) {
-        password_handle.buffer.reset();
-    }
-
-    if (provided_password.buffer.get()) {
-        memset_s(provided_password.buffer.get(), 0, provided_password.length);
-        provided_password.buffer.reset();
-    }
+    password_handle.Release();
+    provided_password.Release();
 }
 
 uint32_t VerifyRequest::nonErrorSerializedSize() const {
@@ -172,29 +338,41 @@ void VerifyRequest::nonErrorSerialize(uint8_t *buffer) const {
 gatekeeper_error_t VerifyRequest::nonErrorDeserialize(const uint8_t *payload, const uint8_t *end) {
     gatekeeper_error_t error = ERROR_NONE;
 
-    if (password_handle.buffer.get()) {
-        password_handle.buffer.reset();
-    }
-
-    if (provided_password.buffer.get()) {
-        memset_s(provided_password.buffer.get(), 0, provided_password.length);
-        provided_password.buffer.reset();
-    }
+    password_handle.Clear();
+    provided_password.Clear();
 
+    if (!remaining_at_least(payload, end, sizeof(challenge))) return ERROR_INVALID;
     memcpy(&challenge, payload, sizeof(challenge));
     payload += sizeof(challenge);
 
-    error = read_from_buffer(&payload, end, &password_handle);
+    error = read_from_buffer(&payload, end, &password_handle, borrow_buffers, arena);
     if (error != ERROR_NONE) return error;
 
-    return read_from_buffer(&payload, end, &provided_password);
+    return read_from_buffer(&payload, end, &provided_password, borrow_buffers, arena);
+
+}
+
+uint32_t VerifyRequest::nonErrorFrameFixedSize() const {
+    return sizeof(challenge);
+}
+
+void VerifyRequest::nonErrorFrameSerialize(uint8_t *fixed) const {
+    *reinterpret_cast<uint64_t *>(fixed) = challenge;
+}
+
+void VerifyRequest::nonErrorFrameDeserialize(const uint8_t *fixed) {
+    challenge = *reinterpret_cast<const uint64_t *>(fixed);
+}
 
+uint32_t VerifyRequest::frameBuffers(SizedBuffer **buffers) {
+    buffers[0] = &password_handle;
+    buffers[1] = &provided_password;
+    return 2;
 }
 
 VerifyResponse::VerifyResponse(uint32_t user_id, SizedBuffer *auth_token) {
     this->user_id = user_id;
-    this->auth_token.buffer.reset(auth_token->buffer.release());
-    this->auth_token.length = auth_token->length;
+    this->auth_token.Take(auth_token);
     this->request_reenroll = false;
 }
 
@@ -210,8 +388,7 @@ VerifyResponse::~VerifyResponse() {
 }
 
 void VerifyResponse::SetVerificationToken(SizedBuffer *auth_token) {
-    this->auth_token.buffer.reset(auth_token->buffer.release());
-    this->auth_token.length = auth_token->length;
+    this->auth_token.Take(auth_token);
 }
 
 uint32_t VerifyResponse::nonErrorSerializedSize() const {
@@ -224,39 +401,55 @@ void VerifyResponse::nonErrorSerialize(uint8_t *buffer) const {
 }
 
 gatekeeper_error_t VerifyResponse::nonErrorDeserialize(const uint8_t *payload, const uint8_t *end) {
-    if (auth_token.buffer.get()) {
-        auth_token.buffer.reset();
-    }
+    auth_token.Clear();
 
-    gatekeeper_error_t err = read_from_buffer(&payload, end, &auth_token);
+    gatekeeper_error_t err = read_from_buffer(&payload, end, &auth_token, borrow_buffers, arena);
     if (err != ERROR_NONE) {
         return err;
     }
 
-    memcpy(&request_reenroll, payload, sizeof(request_reenroll));
+    // Read as a byte, a peer may send anything in place of a bool. Responses
+    // of older peers end before it.
+    uint8_t reenroll = 0;
+    if (remaining_at_least(payload, end, sizeof(reenroll))) memcpy(&reenroll, payload, 1);
+    request_reenroll = reenroll != 0;
     return ERROR_NONE;
 }
 
+uint32_t VerifyResponse::nonErrorFrameFixedSize() const {
+    return sizeof(uint32_t);
+}
+
+void VerifyResponse::nonErrorFrameSerialize(uint8_t *fixed) const {
+    *reinterpret_cast<uint32_t *>(fixed) = request_reenroll;
+}
+
+void VerifyResponse::nonErrorFrameDeserialize(const uint8_t *fixed) {
+    request_reenroll = *reinterpret_cast<const uint32_t *>(fixed) != 0;
+}
+
+uint32_t VerifyResponse::frameBuffers(SizedBuffer **buffers) {
+    buffers[0] = &auth_token;
+    return 1;
+}
+
 EnrollRequest::EnrollRequest(uint32_t user_id, SizedBuffer *password_handle,
         SizedBuffer *provided_password,  SizedBuffer *enrolled_password) {
     this->user_id = user_id;
-    this->provided_password.buffer.reset(provided_password->buffer.release());
-    this->provided_password.length = provided_password->length;
+    this->provided_password.Take(provided_password);
 
     if (enrolled_password == NULL) {
         this->enrolled_password.buffer.reset();
         this->enrolled_password.length = 0;
     } else {
-        this->enrolled_password.buffer.reset(enrolled_password->buffer.release());
-        this->enrolled_password.length = enrolled_password->length;
+        this->enrolled_password.Take(enrolled_password);
     }
 
     if (password_handle == NULL) {
         this->password_handle.buffer.reset();
         this->password_handle.length = 0;
     } else {
-        this->password_handle.buffer.reset(password_handle->buffer.release());
-        this->password_handle.length = password_handle->length;
+        this->password_handle.Take(password_handle);
     }
 }
 
@@ -267,20 +460,9 @@ EnrollRequest::EnrollRequest() {
 }
 
 EnrollRequest::~EnrollRequest() {
-    if (provided_password.buffer.get()) {
-        memset_s(provided_password.buffer.get(), 0, provided_password.length);
-        provided_password.buffer.reset();
-    }
-
-    if (enrolled_password.buffer.get()) {
-        memset_s(enrolled_password.buffer.get(), 0, enrolled_password.length);
-        enrolled_password.buffer.reset();
-    }
-
-    if (password_handle.buffer.get()) {
-        memset_s(password_handle.buffer.get(), 0, password_handle.length);
-        password_handle.buffer.reset();
-    }
+    provided_password.Release();
+    enrolled_password.Release();
+    password_handle.Release();
 }
 
 uint32_t EnrollRequest::nonErrorSerializedSize() const {
@@ -296,38 +478,33 @@ void EnrollRequest::nonErrorSerialize(uint8_t *buffer) const {
 
 gatekeeper_error_t EnrollRequest::nonErrorDeserialize(const uint8_t *payload, const uint8_t *end) {
     gatekeeper_error_t ret;
-    if (provided_password.buffer.get()) {
-        memset_s(provided_password.buffer.get(), 0, provided_password.length);
-        provided_password.buffer.reset();
-    }
-
-    if (enrolled_password.buffer.get()) {
-        memset_s(enrolled_password.buffer.get(), 0, enrolled_password.length);
-        enrolled_password.buffer.reset();
-    }
-
-    if (password_handle.buffer.get()) {
-        memset_s(password_handle.buffer.get(), 0, password_handle.length);
-        password_handle.buffer.reset();
-    }
+    provided_password.Clear();
+    enrolled_password.Clear();
+    password_handle.Clear();
 
-     ret = read_from_buffer(&payload, end, &provided_password);
+     ret = read_from_buffer(&payload, end, &provided_password, borrow_buffers, arena);
      if (ret != ERROR_NONE) {
          return ret;
      }
 
-     ret = read_from_buffer(&payload, end, &enrolled_password);
+     ret = read_from_buffer(&payload, end, &enrolled_password, borrow_buffers, arena);
      if (ret != ERROR_NONE) {
          return ret;
      }
 
-     return read_from_buffer(&payload, end, &password_handle);
+     return read_from_buffer(&payload, end, &password_handle, borrow_buffers, arena);
+}
+
+uint32_t EnrollRequest::frameBuffers(SizedBuffer **buffers) {
+    buffers[0] = &provided_password;
+    buffers[1] = &enrolled_password;
+    buffers[2] = &password_handle;
+    return 3;
 }
 
 EnrollResponse::EnrollResponse(uint32_t user_id, SizedBuffer *enrolled_password_handle) {
     this->user_id = user_id;
-    this->enrolled_password_handle.buffer.reset(enrolled_password_handle->buffer.release());
-    this->enrolled_password_handle.length = enrolled_password_handle->length;
+    this->enrolled_password_handle.Take(enrolled_password_handle);
 }
 
 EnrollResponse::EnrollResponse() {
@@ -335,14 +512,11 @@ EnrollResponse::EnrollResponse() {
 }
 
 EnrollResponse::~EnrollResponse() {
-    if (enrolled_password_handle.buffer.get()) {
-        enrolled_password_handle.buffer.reset();
-    }
+    enrolled_password_handle.Release();
 }
 
 void EnrollResponse::SetEnrolledPasswordHandle(SizedBuffer *enrolled_password_handle) {
-    this->enrolled_password_handle.buffer.reset(enrolled_password_handle->buffer.release());
-    this->enrolled_password_handle.length = enrolled_password_handle->length;
+    this->enrolled_password_handle.Take(enrolled_password_handle);
 }
 
 uint32_t EnrollResponse::nonErrorSerializedSize() const {
@@ -354,12 +528,60 @@ void EnrollResponse::nonErrorSerialize(uint8_t *buffer) const {
 }
 
 gatekeeper_error_t EnrollResponse::nonErrorDeserialize(const uint8_t *payload, const uint8_t *end) {
-    if (enrolled_password_handle.buffer.get()) {
-        enrolled_password_handle.buffer.reset();
-    }
+    enrolled_password_handle.Clear();
 
-    return read_from_buffer(&payload, end, &enrolled_password_handle);
+    return read_from_buffer(&payload, end, &enrolled_password_handle, borrow_buffers, arena);
 }
 
-};
+uint32_t EnrollResponse::frameBuffers(SizedBuffer **buffers) {
+    buffers[0] = &enrolled_password_handle;
+    return 1;
+}
+
+GetStatsRequest::GetStatsRequest(uint32_t user_id) {
+    this->user_id = user_id;
+}
+
+GetStatsRequest::GetStatsRequest() {
+    user_id = 0;
+}
+
+GetStatsResponse::GetStatsResponse(uint32_t user_id, const gatekeeper_stats_t &stats) {
+    this->user_id = user_id;
+    this->stats = stats;
+}
+
+GetStatsResponse::GetStatsResponse() {
+    user_id = 0;
+    memset(&stats, 0, sizeof(stats));
+}
 
+uint32_t GetStatsResponse::nonErrorSerializedSize() const {
+    return sizeof(stats);
+}
+
+void GetStatsResponse::nonErrorSerialize(uint8_t *buffer) const {
+    memcpy(buffer, &stats, sizeof(stats));
+}
+
+gatekeeper_error_t GetStatsResponse::nonErrorDeserialize(const uint8_t *payload,
+        const uint8_t *end) {
+    if (!remaining_at_least(payload, end, sizeof(stats))) return ERROR_INVALID;
+
+    memcpy(&stats, payload, sizeof(stats));
+    return ERROR_NONE;
+}
+
+uint32_t GetStatsResponse::nonErrorFrameFixedSize() const {
+    return sizeof(stats);
+}
+
+void GetStatsResponse::nonErrorFrameSerialize(uint8_t *fixed) const {
+    memcpy(fixed, &stats, sizeof(stats));
+}
+
+void GetStatsResponse::nonErrorFrameDeserialize(const uint8_t *fixed) {
+    memcpy(&stats, fixed, sizeof(stats));
+}
+
+};
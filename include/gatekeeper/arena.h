@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_ARENA_H_
+#define GATEKEEPER_ARENA_H_
+
+#include <stdint.h>
+
+#include "gatekeeper_utils.h"
+
+namespace gatekeeper {
+
+/**
+ * Fixed size bump allocator for the short-lived buffers of a single
+ * request, backed by memory supplied by the caller (e.g. a static buffer
+ * in a trusted app). Allocations are never freed individually; Reset
+ * wipes and reclaims all of them at once, and should be called once the
+ * response has been sent.
+ */
+class Arena {
+public:
+    Arena(uint8_t *memory, uint32_t size) : memory_(memory), size_(size), used_(0) {}
+
+    ~Arena() {
+        Reset();
+    }
+
+    /**
+     * Returns length bytes aligned to 8, or NULL if the arena is exhausted.
+     */
+    uint8_t *Allocate(uint32_t length) {
+        uint32_t aligned = (length + 7) & ~7u;
+        if (aligned < length || aligned > size_ - used_) return NULL;
+
+        uint8_t *result = memory_ + used_;
+        used_ += aligned;
+        return result;
+    }
+
+    /**
+     * Wipes every allocation made since the last Reset and makes the space
+     * available again.
+     */
+    void Reset() {
+        memset_s(memory_, 0, used_);
+        used_ = 0;
+    }
+
+    uint32_t used() const { return used_; }
+    uint32_t size() const { return size_; }
+
+private:
+    Arena(const Arena &);
+    void operator=(const Arena &);
+
+    uint8_t *memory_;
+    uint32_t size_;
+    uint32_t used_;
+};
+
+}
+
+#endif // GATEKEEPER_ARENA_H_
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_FAILURE_RECORD_CACHE_H_
+#define GATEKEEPER_FAILURE_RECORD_CACHE_H_
+
+#include <stdint.h>
+
+#include "gatekeeper.h"
+
+namespace gatekeeper {
+
+/**
+ * One persisted failure record state. The checksum covers every preceding
+ * field and lets a replay detect an entry torn by a power loss.
+ */
+struct __attribute__((packed)) failure_record_journal_entry_t {
+    uint32_t uid;
+    failure_record_t record;
+    uint32_t checksum;
+};
+
+/**
+ * Append-only storage backing a FailureRecordCache, implemented by the
+ * platform on top of RPMB or similar secure storage.
+ */
+class FailureRecordJournal {
+public:
+    virtual ~FailureRecordJournal() {}
+
+    /**
+     * Durably appends entry to the end of the journal.
+     */
+    virtual bool Append(const failure_record_journal_entry_t *entry) = 0;
+
+    /**
+     * Reads the entry at index. Returns false if index is past the end of
+     * the journal or the entry cannot be read.
+     */
+    virtual bool Read(uint32_t index, failure_record_journal_entry_t *entry) = 0;
+
+    /**
+     * Atomically replaces the whole journal with count entries. Either the
+     * old or the new journal must survive a power loss, never a mix.
+     */
+    virtual bool Rewrite(const failure_record_journal_entry_t *entries, uint32_t count) = 0;
+};
+
+/**
+ * Write-back cache of failure records for GateKeeper implementations.
+ *
+ * Records are kept in a fixed size in-memory table keyed by uid, so reads
+ * never touch storage. Only transitions that matter for lockout are
+ * persisted synchronously: a write that raises a failure counter above
+ * its persisted value is appended to the journal before Write returns.
+ * Clears and timestamp-only updates, which can only make throttling
+ * less strict, are kept dirty in memory and persisted by the next journal
+ * append for that uid, by Flush, or by compaction.
+ *
+ * The journal is compacted into one entry per uid once it grows past a
+ * multiple of the table capacity. Empty records, which read the same as no
+ * record at all, don't hold on to a slot once that state is durable: their
+ * slots are freed as soon as the journal agrees, and compaction, also run
+ * when a new uid finds the table full, drops the rest. The table thus only
+ * fills up with capacity uids that all have failures on record.
+ *
+ * Intended to back GetFailureRecord, WriteFailureRecord and
+ * ClearFailureRecord of a GateKeeper subclass.
+ */
+class FailureRecordCache {
+public:
+    /**
+     * Creates a cache for at most capacity distinct uids, persisted to
+     * journal. The journal is not owned.
+     */
+    FailureRecordCache(FailureRecordJournal *journal, uint32_t capacity);
+    ~FailureRecordCache();
+
+    /**
+     * Rebuilds the table by replaying the journal, e.g. after a reboot. A
+     * torn entry at the tail is dropped and the journal compacted.
+     *
+     * Returns false if the journal could not be replayed or holds more uids
+     * than the cache has room for.
+     */
+    bool Load();
+
+    /**
+     * Returns the record for uid. If none is stored, or it belongs to a
+     * different user_id, returns an empty record for user_id.
+     */
+    bool Get(uint32_t uid, secure_id_t user_id, failure_record_t *record);
+
+    /**
+     * Stores record for uid, persisting it first if it raises the failure
+     * counter. Returns false if it could not be persisted or the table is
+     * full of uids with failures on record.
+     */
+    bool Write(uint32_t uid, const failure_record_t *record);
+
+    /**
+     * Resets the record for uid to an empty record for user_id.
+     */
+    bool Clear(uint32_t uid, secure_id_t user_id);
+
+    /**
+     * Persists every dirty record.
+     */
+    bool Flush();
+
+private:
+    FailureRecordCache(const FailureRecordCache &);
+    void operator=(const FailureRecordCache &);
+
+    struct entry_t {
+        bool in_use;
+        bool dirty;
+        uint32_t uid;
+        failure_record_t record;
+        // last state written to the journal, zero if never written
+        failure_record_t persisted;
+    };
+
+    entry_t *Find(uint32_t uid);
+    entry_t *Insert(uint32_t uid);
+    entry_t *FindOrInsert(uint32_t uid);
+    void ReleaseIfEmpty(entry_t *entry);
+    bool Persist(entry_t *entry);
+    bool Compact();
+
+    FailureRecordJournal *journal_;
+    UniquePtr<entry_t[]> entries_;
+    uint32_t capacity_;
+    uint32_t journal_length_;
+};
+
+}
+
+#endif // GATEKEEPER_FAILURE_RECORD_CACHE_H_
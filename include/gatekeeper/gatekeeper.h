@@ -22,41 +22,611 @@
 #include <hardware/hw_auth_token.h>
 
 #include "gatekeeper_messages.h"
+#include "gatekeeper_observer.h"
 #include "password_handle.h"
+#include "throttle_schedule.h"
 
 namespace gatekeeper {
 
 struct __attribute__((packed)) failure_record_t {
     uint64_t secure_user_id;
+    // milliseconds since boot, tagged with the boot session in the top bits
+    // when the implementation provides GetBootSessionId
     uint64_t last_checked_timestamp;
     uint32_t failure_counter;
 };
 
+/**
+ * Statically dispatched core of GateKeeper. Platform derives from
+ * GateKeeperT<Platform> and provides the platform hooks documented on
+ * GateKeeper below as non-virtual members, which must be accessible to
+ * GateKeeperT, e.g. by declaring it a friend. Optional hooks fall back to the
+ * defaults defined here when Platform does not declare them.
+ *
+ * Every hook call is resolved at compile time, so implementations whose
+ * platform is fixed at build time can have them inlined into the request
+ * path. Member definitions live in gatekeeper_impl.h, which such
+ * implementations include to instantiate GateKeeperT for their Platform.
+ */
+template <typename Platform>
+class GateKeeperT {
+public:
+    void Enroll(const EnrollRequest &request, EnrollResponse *response);
+    void Verify(const VerifyRequest &request, VerifyResponse *response);
+
+    /**
+     * Enrolls count requests at once, writing the result of requests[i] to
+     * responses[i]. Each result is the same as a separate call to Enroll,
+     * which makes this the way to migrate the handles of several users, e.g.
+     * those Verify asked to re-enroll after an upgrade, by passing each
+     * user's handle and password as both the current and the new password.
+     *
+     * The clock, password key and KDF parameters are fetched once for the
+     * whole batch, and the failure records of all requests carrying a handle
+     * are checked and incremented before any old password is checked. The
+     * salts and new secure ids come from one draw per eight enrollments,
+     * served from the random pool if enabled.
+     * Implementations supporting failure record transactions see one commit
+     * for the increments and one for the clears of every eight enrollments.
+     */
+    void EnrollBatch(const EnrollRequest *requests, size_t count, EnrollResponse *responses);
+
+    /**
+     * Verifies count requests at once, writing the result of requests[i] to
+     * responses[i]. Each result is the same as a separate call to Verify, but
+     * the clock, password key and auth token key are fetched once for the
+     * whole batch, and the failure records of all requests are read and
+     * incremented before any password is checked. Implementations supporting
+     * failure record transactions see one commit for the increments and one
+     * for the clears.
+     */
+    void VerifyBatch(const VerifyRequest *requests, size_t count, VerifyResponse *responses);
+
+    /**
+     * Asynchronous form of Verify for implementations whose failure record
+     * storage completes writes through events, such as RPMB.
+     *
+     * If the implementation supports failure record transactions and
+     * StartFailureRecordCommit starts the commit of the failure record
+     * increment, the password is checked while the write is in flight and
+     * VerifyAsync returns false. The verification is then pending: request
+     * and response must stay alive until the implementation reports the
+     * outcome of the commit with CompleteVerifyAsync, and nothing is written
+     * to response before the increment is known to be durable.
+     *
+     * Otherwise the verification completes as in Verify and VerifyAsync
+     * returns true. Only one verification can be pending at a time: until it
+     * completes, further VerifyAsync calls as well as Enroll, Verify and their
+     * batch forms, HandleMessage included, fail with ERROR_UNKNOWN without
+     * touching failure records. GetStats still answers.
+     */
+    bool VerifyAsync(const VerifyRequest &request, VerifyResponse *response);
+
+    /**
+     * Resumes the pending VerifyAsync once the commit started by
+     * StartFailureRecordCommit has finished, durably if committed is true.
+     *
+     * Returns the now complete response of the pending verification, or NULL
+     * if none was pending.
+     */
+    VerifyResponse *CompleteVerifyAsync(bool committed);
+
+    /**
+     * Returns the outcome counters aggregated since construction.
+     */
+    void GetStats(const GetStatsRequest &request, GetStatsResponse *response);
+
+    /**
+     * Handles one serialized request end to end: deserializes the in_length
+     * bytes at in as the request for cmd (ENROLL, VERIFY or GET_STATS), runs
+     * it, and serializes the response into out.
+     *
+     * The request is parsed as a view of in, and the buffers placed in the
+     * response come from scratch space on the stack, so the round trip does
+     * not allocate. A request that fails to parse is answered with an
+     * ERROR_INVALID response.
+     *
+     * Returns the size of the response. Like SerializeInto, a value greater
+     * than out_capacity means nothing was written; the request has still
+     * been executed, so size out for the largest response up front. Returns
+     * 0 for an unknown cmd.
+     */
+    uint32_t HandleMessage(uint32_t cmd, const uint8_t *in, uint32_t in_length, uint8_t *out,
+            uint32_t out_capacity);
+
+    /**
+     * Installs observer to receive phase begin and end events for every
+     * subsequent request, or removes it if NULL. The observer is not owned.
+     * Without an observer tracing costs one pointer test per phase.
+     */
+    void SetObserver(GateKeeperObserver *observer) { observer_ = observer; }
+
+    /**
+     * Notifies GateKeeper that the auth token key may have changed. Bumps the
+     * key epoch, so that the next successful verification fetches the key again
+     * instead of using the cached copy, which is wiped at that point.
+     *
+     * Only meaningful after EnableAuthTokenKeyCache. The epoch is updated
+     * atomically, so this may be called from any thread, including while a
+     * VerifyBatch is in progress, whose tokens are then still signed with the
+     * key it started with.
+     */
+    void InvalidateAuthTokenKey() {
+        __atomic_fetch_add(&auth_token_key_epoch_, 1, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * Picks the cost of params->algorithm so that one DerivePassword call takes
+     * about target_ms on the current hardware, timed with
+     * GetMillisecondsSinceBoot. The other fields of params are left as given,
+     * and a non-zero params->cost is used as the starting point.
+     *
+     * Returns false if the implementation cannot derive with params, or if the
+     * target cannot be reached with a 32 bit cost.
+     */
+    bool CalibratePasswordKdf(uint32_t target_ms, password_kdf_params_t *params);
+
+    /**
+     * Exposes the throttle schedule used by the default ComputeRetryTimeout,
+     * so that tooling can inspect the lockout policy.
+     */
+    void GetThrottleSchedule(const uint32_t **timeouts, uint32_t *length) const {
+        *timeouts = throttle_schedule_;
+        *length = throttle_schedule_length_;
+    }
+
+protected:
+    GateKeeperT() : batch_password_key_(NULL), batch_password_key_length_(0),
+            throttle_schedule_(DEFAULT_THROTTLE_SCHEDULE),
+            throttle_schedule_length_(DEFAULT_THROTTLE_SCHEDULE_LENGTH),
+            cache_auth_token_key_(false), cached_auth_token_key_length_(0),
+            cached_auth_token_key_epoch_(0), auth_token_key_epoch_(0),
+            prepared_password_key_length_(0),
+            prepared_password_key_state_(PREPARED_KEY_UNPREPARED), verify_cache_ttl_ms_(0),
+            verify_cache_next_(0), verify_cache_keyed_(false), concurrent_(false),
+            async_request_(NULL),
+            async_response_(NULL), async_timestamp_(0), async_matched_(false),
+            boot_anchor_next_(0), random_pool_size_(0), random_pool_offset_(0),
+            random_pool_max_age_ms_(0), random_pool_filled_at_(0), observer_(NULL) {
+        memset(&stats_, 0, sizeof(stats_));
+    }
+    ~GateKeeperT() {
+        DropCachedAuthTokenKey();
+        DropPreparedPasswordKey();
+        DropVerifyCache();
+        DropRandomPool();
+    }
+
+    /**
+     * Replaces the default throttle schedule, see throttle_schedule.h. timeouts
+     * must outlive this object. Passing NULL or an empty table restores the
+     * default schedule.
+     *
+     * Intended to be called from the constructor of subclasses that want a
+     * custom lockout curve without overriding ComputeRetryTimeout.
+     */
+    void SetThrottleSchedule(const uint32_t *timeouts, uint32_t length);
+
+    /**
+     * Opts in to fast verification. GateKeeper then remembers in memory which
+     * users' last attempt succeeded from a clean failure record, so that such an
+     * attempt costs a single failure record write, the increment, and the clear
+     * that would normally follow is skipped. The next attempt ignores the stale
+     * count of one this leaves in storage.
+     *
+     * That state can't be persisted without a write once the outcome is known,
+     * which is the one this saves, so it is tracked for a few users at a time.
+     * Users beyond those take the usual path, a tracked user is never dropped
+     * in their favour. Only a reboot loses it: the first attempt after boot
+     * then treats the stale count as a real failure, which can only make
+     * throttling stricter, and clears it if it succeeds.
+     */
+    void EnableFastVerify();
+
+    /**
+     * Opts in to caching the auth token key. GateKeeper then keeps the key
+     * returned by GetAuthTokenKey across requests, tagged with the current key
+     * epoch, rather than fetching it for every batch that mints a token.
+     *
+     * Implementations enabling the cache MUST call InvalidateAuthTokenKey
+     * whenever the key may have changed.
+     */
+    void EnableAuthTokenKeyCache() { cache_auth_token_key_ = true; }
+
+    /**
+     * Opts in to remembering successful password checks for ttl_ms, so that
+     * re-verifying the same password against the same handle shortly after,
+     * e.g. in a confirm-credential flow right after unlock, skips DoVerify
+     * and with it any expensive KDF. Throttling, failure record updates and
+     * token minting are unaffected.
+     *
+     * Entries are keyed by uid, handle signature and an HMAC of the password
+     * under a random per-instance key; the password itself is never stored.
+     * The cache holds a handful of entries. They are wiped when their uid
+     * enrolls or fails a check, on destruction, and once expired the next
+     * time the cache is consulted.
+     */
+    void EnableVerifyCache(uint32_t ttl_ms);
+
+    /**
+     * Opts in to handing out salts and secure ids from an in-memory pool of
+     * random bytes, refilled with a single GetRandom call of size bytes
+     * whenever it runs dry, instead of calling GetRandom for each of them.
+     *
+     * Bytes are wiped from the pool as they are handed out. The whole pool
+     * is wiped and refilled on the next draw once max_age_ms have passed
+     * since it was filled, never if 0, and wiped on destruction. Draws
+     * larger than the pool, and all draws in concurrent mode, go straight
+     * to GetRandom. A size of 0 turns the pool off again.
+     */
+    void EnableRandomPool(uint32_t size, uint32_t max_age_ms);
+
+    /**
+     * Opts in to concurrent Enroll, Verify and GetStats calls, for software
+     * implementations hosted in a multi-threaded HAL. Each request that
+     * touches a user's failure record then runs between LockUser and
+     * UnlockUser for its uid, so requests for different users proceed in
+     * parallel while those for the same user serialize and keep the
+     * throttle counter exact. Outcome counters are updated atomically. The
+     * platform hooks other than the failure record ones must be safe to call
+     * concurrently.
+     *
+     * The request-spanning caches have no place in this mode: the password
+     * key is fetched per request, the auth token key cache and fast
+     * verification are ignored, batches run request by request and
+     * VerifyAsync completes synchronously. Must be called before the first
+     * request, typically from the subclass constructor.
+     */
+    void EnableConcurrentRequests() { concurrent_ = true; }
+
+    // Defaults of the optional platform hooks, see GateKeeper
+    bool BeginPasswordSignature(const uint8_t *, uint32_t, salt_t) { return false; }
+    void UpdatePasswordSignature(const uint8_t *, uint32_t) {}
+    void FinishPasswordSignature(uint8_t *, uint32_t) {}
+    uint32_t GetPreparedPasswordKeySize() const { return 0; }
+    bool PreparePasswordKey(uint8_t *, uint32_t, const uint8_t *, uint32_t) { return false; }
+    void BeginPreparedPasswordSignature(const uint8_t *, uint32_t, salt_t) {}
+    bool BeginSignature(const uint8_t *, uint32_t) { return false; }
+    void UpdateSignature(const uint8_t *, uint32_t) {}
+    void FinishSignature(uint8_t *, uint32_t) {}
+    uint64_t GetTraceTimestamp() const { return platform()->GetMillisecondsSinceBoot() * 1000000; }
+    uint32_t GetBootSessionId() const { return 0; }
+    bool BeginFailureRecordTransaction() { return false; }
+    bool CommitFailureRecordTransaction() { return true; }
+    bool StartFailureRecordCommit() { return false; }
+    void LockUser(uint32_t) {}
+    void UnlockUser(uint32_t) {}
+    bool GetPasswordKdfParams(password_kdf_params_t *) const { return false; }
+    bool DerivePassword(uint8_t *, uint32_t, const password_kdf_params_t *, const uint8_t *,
+            uint32_t, salt_t) {
+        return false;
+    }
+    uint32_t ComputeRetryTimeout(const failure_record_t *record);
+    bool DoVerify(const password_handle_t *expected_handle, const SizedBuffer &password);
+
+private:
+    template <typename Request, typename Response>
+    uint32_t HandleRequest(void (GateKeeperT::*handler)(const Request &, Response *),
+            const uint8_t *in, uint32_t in_length, uint8_t *out, uint32_t out_capacity);
+
+    void EnrollBatchInternal(const EnrollRequest *requests, size_t count,
+            EnrollResponse *responses);
+
+    /**
+     * First half of an enrollment: validates the request and, for a throttled
+     * current handle, checks the throttle window and increments the failure
+     * record, as BeginVerify does.
+     *
+     * Returns true if the enrollment may proceed, in which case
+     * response->retry_timeout holds the timeout to report if the old password
+     * doesn't match. Otherwise the outcome has been written to response.
+     */
+    bool BeginEnroll(const EnrollRequest &request, uint64_t timestamp, EnrollResponse *response);
+
+    /**
+     * Second half of an enrollment, once the failure record increments are
+     * durable: checks the old passwords, then clears the failure records and
+     * creates the new handles of the requests BeginEnroll left pending, a
+     * chunk of at most ENROLL_BATCH_CHUNK requests at a time.
+     */
+    void FinishEnrollBatch(const EnrollRequest *requests, size_t count,
+            EnrollResponse *responses);
+    void FinishEnrollChunk(const EnrollRequest *requests, size_t count,
+            EnrollResponse *responses, const password_kdf_params_t *kdf_params);
+    void VerifyBatchInternal(const VerifyRequest *requests, size_t count,
+            VerifyResponse *responses);
+
+    /**
+     * Second half of a verification, once the failure record increments are
+     * durable: checks the passwords of the requests BeginVerify left pending,
+     * unless matched already holds the outcome, then mints tokens and clears
+     * failure records. FailUncommitted instead fails the pending requests.
+     */
+    void FinishVerifyBatch(const VerifyRequest *requests, size_t count,
+            VerifyResponse *responses, uint64_t timestamp, const bool *matched);
+    template <typename Response>
+    void FailUncommitted(Response *responses, size_t count);
+
+    /**
+     * Clears the outcome a reused response may still hold: the error, the
+     * retry timeout and the subclass specific scalars such as
+     * request_reenroll. user_id and the buffers, whose memory is reused,
+     * are left alone.
+     */
+    template <typename Response>
+    static void ResetResponses(Response *responses, size_t count);
+
+    /**
+     * Fails every response with ERROR_UNKNOWN if a VerifyAsync is pending,
+     * whose failure record transaction is still in flight.
+     */
+    template <typename Response>
+    bool FailIfAsyncPending(Response *responses, size_t count);
+
+    /**
+     * Generates a signed attestation of an authentication event in place in
+     * token, which is typically the verification token buffer of the response.
+     * If auth_token_key is NULL the token is left unsigned.
+     */
+    void MintAuthToken(hw_auth_token_t *token, uint64_t timestamp, secure_id_t user_id,
+            secure_id_t authenticator_id, uint64_t challenge, const uint8_t *auth_token_key,
+            uint32_t key_len);
+
+    /**
+     * Fetches the auth token key, or returns the cached copy if the cache is
+     * enabled and the key epoch has not changed since it was fetched.
+     * The key must be handed back to ReleaseAuthTokenKey.
+     */
+    bool AcquireAuthTokenKey(const uint8_t **auth_token_key, uint32_t *length);
+    void ReleaseAuthTokenKey(const uint8_t *auth_token_key, uint32_t length);
+    void DropCachedAuthTokenKey();
+
+    /**
+     * Returns the prepared form of the password key, preparing it on first use,
+     * or NULL if the implementation does not support prepared keys.
+     */
+    const uint8_t *GetPreparedPasswordKey(const uint8_t *key, uint32_t key_length);
+    void DropPreparedPasswordKey();
+
+    /**
+     * First half of a verification: validates the handle and, for throttled
+     * handles, checks the throttle window and increments the failure record.
+     *
+     * Returns true if the password still needs to be checked, in which case
+     * response->retry_timeout holds the timeout to report if it doesn't match.
+     * Otherwise the outcome has been written to response.
+     */
+    bool BeginVerify(const VerifyRequest &request, uint64_t timestamp, VerifyResponse *response);
+
+    /**
+     * Structural checks on a password handle, cheap enough to run before any
+     * storage I/O or crypto: its length fits its version, it has no unknown
+     * flags, and it was created with the hardware backing of this instance.
+     */
+    bool PasswordHandleWellFormed(const SizedBuffer &handle) const;
+
+    /**
+     * DoVerify behind the verify cache, if enabled.
+     */
+    bool CheckPassword(uint32_t uid, const password_handle_t *password_handle,
+            const SizedBuffer &password, uint64_t timestamp);
+    void DropVerifyCacheEntries(uint32_t uid);
+    void DropVerifyCache();
+
+    /**
+     * GetRandom behind the random pool, if enabled.
+     */
+    void DrawRandom(void *random, uint32_t size);
+    void DropRandomPool();
+
+    /**
+     * Populates password_handle with the data provided and computes HMAC
+     * directly into its signature field. From HANDLE_VERSION_KDF on, kdf_params
+     * is recorded in the handle and the password is run through DerivePassword
+     * before being signed. Earlier versions leave kdf untouched, so
+     * password_handle need only hold HANDLE_LENGTH_MIN bytes for them.
+     */
+    bool CreatePasswordHandle(password_handle_t *password_handle, salt_t salt,
+            secure_id_t secure_id, secure_id_t authenticator_id, uint8_t handle_version,
+            const password_kdf_params_t *kdf_params, const uint8_t *password,
+            uint32_t password_length);
+
+    /**
+     * Returns true if password_handle was not created with the current KDF
+     * parameters. Always false when the implementation has no KDF stage.
+     */
+    bool PasswordKdfOutdated(const password_handle_t *password_handle) const;
+
+    /**
+     * Increments the counter on the current failure record for the provided user id.
+     * Sets the last_checked_timestamp to timestamp, tagged with the boot
+     * session if any. Writes the updated record
+     * to *record if not null.
+     *
+     * Returns true if failure record was successfully incremented.
+     */
+    bool IncrementFailureRecord(uint32_t uid, secure_id_t user_id, uint64_t timestamp,
+            failure_record_t *record, bool secure);
+
+    /**
+     * Determines whether the request is within the current throttle window.
+     *
+     * If the system timer has been reset due to a reboot or otherwise, resets
+     * the throttle window with a base at the current time. When the record is
+     * tagged with an earlier boot session that base is kept in memory, see
+     * AnchorBootSession, otherwise it is written back to the record.
+     *
+     * Returns true if the request is in the throttle window.
+     */
+    bool ThrottleRequest(uint32_t uid, uint64_t timestamp,
+            failure_record_t *record, bool secure, GateKeeperMessage *response);
+
+    /**
+     * Traced wrapper of CommitFailureRecordTransaction.
+     */
+    bool CommitFailureRecords();
+
+    /**
+     * The current boot session reduced to the tag stored in failure records,
+     * 0 if the implementation provides none.
+     */
+    uint64_t BootSessionTag() const;
+
+    /**
+     * timestamp as stored in last_checked_timestamp.
+     */
+    uint64_t RecordTimestamp(uint64_t timestamp) const;
+
+    /**
+     * Returns the time the throttle window of uid's record, last checked at
+     * last_checked during an earlier boot, restarted in this boot: the first
+     * time it was seen, or timestamp if that is now.
+     */
+    uint64_t AnchorBootSession(uint32_t uid, uint64_t last_checked, uint64_t timestamp);
+
+    Platform *platform() { return static_cast<Platform *>(this); }
+    const Platform *platform() const { return static_cast<const Platform *>(this); }
+
+    // Password key fetched by VerifyBatch, reused by CreatePasswordHandle
+    // for the remainder of the batch. NULL outside of VerifyBatch.
+    const uint8_t *batch_password_key_;
+    uint32_t batch_password_key_length_;
+
+    const uint32_t *throttle_schedule_;
+    uint32_t throttle_schedule_length_;
+
+    /**
+     * In-memory state of a user's failure record tracked by fast verification.
+     * CLEAN means the stored counter is left over from a successful attempt,
+     * PENDING that an attempt from a clean record is being verified.
+     */
+    enum fast_verify_state_t {
+        FAST_VERIFY_NONE = 0,
+        FAST_VERIFY_CLEAN,
+        FAST_VERIFY_PENDING,
+    };
+
+    struct fast_verify_entry_t {
+        uint32_t uid;
+        secure_id_t user_id;
+        fast_verify_state_t state;
+    };
+
+    fast_verify_state_t GetFastVerifyState(uint32_t uid, secure_id_t user_id) const;
+    void SetFastVerifyState(uint32_t uid, secure_id_t user_id, fast_verify_state_t state);
+
+    // NULL unless EnableFastVerify has been called
+    UniquePtr<fast_verify_entry_t[]> fast_verify_entries_;
+
+    bool cache_auth_token_key_;
+    UniquePtr<uint8_t[]> cached_auth_token_key_;
+    uint32_t cached_auth_token_key_length_;
+    uint32_t cached_auth_token_key_epoch_;
+    // Bumped by InvalidateAuthTokenKey, accessed atomically
+    uint32_t auth_token_key_epoch_;
+
+    enum prepared_key_state_t {
+        PREPARED_KEY_UNPREPARED = 0,
+        PREPARED_KEY_READY,
+        PREPARED_KEY_UNSUPPORTED,
+        // claimed by the request preparing the key, see GetPreparedPasswordKey
+        PREPARED_KEY_PREPARING,
+    };
+
+    UniquePtr<uint8_t[]> prepared_password_key_;
+    uint32_t prepared_password_key_length_;
+    // A prepared_key_state_t, accessed atomically
+    uint32_t prepared_password_key_state_;
+
+    struct verify_cache_entry_t {
+        // 0 for an empty entry
+        uint64_t expires_at;
+        uint32_t uid;
+        // the handle verified against, zero padded past its length
+        uint8_t handle[sizeof(password_handle_t)];
+        uint8_t password_digest[32];
+    };
+
+    // NULL unless EnableVerifyCache has been called
+    UniquePtr<verify_cache_entry_t[]> verify_cache_entries_;
+    uint32_t verify_cache_ttl_ms_;
+    uint32_t verify_cache_next_;
+    uint8_t verify_cache_key_[32];
+    bool verify_cache_keyed_;
+
+    bool concurrent_;
+
+    // The verification left pending by VerifyAsync, response is NULL if none
+    const VerifyRequest *async_request_;
+    VerifyResponse *async_response_;
+    uint64_t async_timestamp_;
+    bool async_matched_;
+
+    struct boot_anchor_t {
+        uint32_t uid;
+        bool used;
+        uint64_t last_checked;
+        uint64_t anchored_at;
+    };
+
+    // NULL until a record from an earlier boot session has been throttled
+    UniquePtr<boot_anchor_t[]> boot_anchors_;
+    uint32_t boot_anchor_next_;
+
+    // NULL unless EnableRandomPool has been called; bytes before offset are used up
+    UniquePtr<uint8_t[]> random_pool_;
+    uint32_t random_pool_size_;
+    uint32_t random_pool_offset_;
+    uint32_t random_pool_max_age_ms_;
+    uint64_t random_pool_filled_at_;
+
+    void TraceBegin(gatekeeper_phase_t phase) const {
+        if (observer_ != NULL) observer_->OnPhaseBegin(phase, platform()->GetTraceTimestamp());
+    }
+
+    void TraceEnd(gatekeeper_phase_t phase) const {
+        if (observer_ != NULL) observer_->OnPhaseEnd(phase, platform()->GetTraceTimestamp());
+    }
+
+    void Count(uint32_t gatekeeper_stats_t::*counter, uint32_t n = 1) {
+        if (concurrent_) {
+            __atomic_fetch_add(&(stats_.*counter), n, __ATOMIC_RELAXED);
+        } else {
+            stats_.*counter += n;
+        }
+    }
+
+    GateKeeperObserver *observer_;
+    // Aligned so that the counters can be updated atomically
+    gatekeeper_stats_t stats_ __attribute__((aligned(4)));
+};
+
 /**
  * Base class for gatekeeper implementations. Provides all functionality except
  * the ability to create/access keys and compute signatures. These are left up
  * to the platform-specific implementation.
+ *
+ * A thin adapter over GateKeeperT whose platform hooks are virtual.
  */
-class GateKeeper {
+class GateKeeper : public GateKeeperT<GateKeeper> {
 public:
     GateKeeper() {}
     virtual ~GateKeeper() {}
 
-    void Enroll(const EnrollRequest &request, EnrollResponse *response);
-    void Verify(const VerifyRequest &request, VerifyResponse *response);
-
 protected:
+    friend class GateKeeperT<GateKeeper>;
 
     // The following methods are intended to be implemented by concrete subclasses
 
     /**
      * Retrieves the key used by GateKeeper::MintAuthToken to sign the payload
      * of the AuthToken. This is not cached as is may have changed due to an event such
-     * as a password change.
+     * as a password change, unless the implementor opts in with EnableAuthTokenKeyCache.
      *
      * Writes the length in bytes of the returned key to length if it is not null.
      *
-     * Ownership of the auth_token_key pointer is maintained by the implementor.
+     * The returned key must be allocated with new[]; GateKeeper takes ownership
+     * of it and wipes it before releasing it.
      *
      * Returns true if the key was successfully fetched.
      *
@@ -90,6 +660,53 @@ protected:
             const uint8_t *key, uint32_t key_length, const uint8_t *password,
             uint32_t password_length, salt_t salt) const = 0;
 
+    /**
+     * Optional streaming counterpart to ComputePasswordSignature, for signers that
+     * can consume the message in pieces without it being copied into one buffer
+     * first (e.g. an HMAC engine doing chunked DMA).
+     *
+     * GateKeeper calls BeginPasswordSignature once, UpdatePasswordSignature for
+     * each piece of the message in order, and FinishPasswordSignature to write
+     * the signature_length size signature. The result must be identical to the
+     * one ComputePasswordSignature produces for the concatenated message.
+     *
+     * The default BeginPasswordSignature returns false, in which case GateKeeper
+     * falls back to ComputePasswordSignature.
+     */
+    virtual bool BeginPasswordSignature(const uint8_t * /* key */, uint32_t /* key_length */,
+            salt_t /* salt */) {
+        return false;
+    }
+    virtual void UpdatePasswordSignature(const uint8_t * /* message */, uint32_t /* length */) {}
+    virtual void FinishPasswordSignature(uint8_t * /* signature */,
+            uint32_t /* signature_length */) {}
+
+    /**
+     * Optional precomputed signing context for the password key, e.g. the HMAC
+     * inner and outer hash states after absorbing the padded key. Since the
+     * password key can be cached, GateKeeper prepares it once and then starts
+     * every password signature from the prepared context instead of the raw key.
+     *
+     * GetPreparedPasswordKeySize returns the size in bytes of the context, or 0
+     * if preparation is not supported, which is the default. GateKeeper owns the
+     * context buffer and wipes it on destruction. PreparePasswordKey fills it in
+     * from the raw key and returns false on failure, in which case GateKeeper
+     * keeps using the raw key.
+     *
+     * BeginPreparedPasswordSignature replaces BeginPasswordSignature when a
+     * prepared key is available, and is followed by the same
+     * UpdatePasswordSignature and FinishPasswordSignature calls. The result must
+     * be identical to the one ComputePasswordSignature produces for the raw key.
+     */
+    virtual uint32_t GetPreparedPasswordKeySize() const { return 0; }
+    virtual bool PreparePasswordKey(uint8_t * /* prepared_key */,
+            uint32_t /* prepared_key_length */, const uint8_t * /* key */,
+            uint32_t /* key_length */) {
+        return false;
+    }
+    virtual void BeginPreparedPasswordSignature(const uint8_t * /* prepared_key */,
+            uint32_t /* prepared_key_length */, salt_t /* salt */) {}
+
     /**
      * Retrieves a unique, cryptographically randomly generated buffer for use in password
      * hashing, etc.
@@ -107,6 +724,17 @@ protected:
             const uint8_t *key, uint32_t key_length, const uint8_t *message,
             const uint32_t length) const = 0;
 
+    /**
+     * Optional streaming counterpart to ComputeSignature. Follows the same
+     * Begin/Update/Finish contract as BeginPasswordSignature, and likewise
+     * falls back to ComputeSignature when BeginSignature returns false.
+     */
+    virtual bool BeginSignature(const uint8_t * /* key */, uint32_t /* key_length */) {
+        return false;
+    }
+    virtual void UpdateSignature(const uint8_t * /* message */, uint32_t /* length */) {}
+    virtual void FinishSignature(uint8_t * /* signature */, uint32_t /* signature_length */) {}
+
     /**
      * Get the time since boot in milliseconds.
      *
@@ -114,6 +742,28 @@ protected:
      */
     virtual uint64_t GetMillisecondsSinceBoot() const = 0;
 
+    /**
+     * Timestamp in nanoseconds passed to the GateKeeperObserver, if any. Must
+     * be monotonic. Defaults to GetMillisecondsSinceBoot; override to supply a
+     * finer clock.
+     */
+    virtual uint64_t GetTraceTimestamp() const {
+        return GetMillisecondsSinceBoot() * 1000000;
+    }
+
+    /**
+     * Optional identifier of the current boot, which must differ from that of
+     * the previous boots, e.g. a counter in secure storage bumped early during
+     * boot. It is reduced to a 20 bit tag stored in the top bits of
+     * last_checked_timestamp, so a counter may wrap.
+     *
+     * With it a throttled record is known to come from an earlier boot even
+     * when the clock has since passed its timestamp, and its throttle window
+     * restarts without the failure record write that resetting it otherwise
+     * takes. The default returns 0, meaning no session is available.
+     */
+    virtual uint32_t GetBootSessionId() const { return 0; }
+
     /**
      * Returns the value of the current failure record for the user.
      *
@@ -153,61 +803,90 @@ protected:
     virtual bool WriteFailureRecord(uint32_t uid, failure_record_t *record, bool secure) = 0;
 
     /**
-     * Computes the amount of time to throttle the user due to the current failure_record
-     * counter. An implementation is provided by the generic GateKeeper, but may be
-     * overriden.
+     * Optional hooks for grouping failure record updates. Between a successful
+     * BeginFailureRecordTransaction and the matching CommitFailureRecordTransaction,
+     * implementations may stage WriteFailureRecord and ClearFailureRecord in memory
+     * and persist them together in the commit, e.g. as a single RPMB write.
+     * GetFailureRecord must observe staged updates.
+     *
+     * GateKeeper only checks a password once the commit covering its failure
+     * increment has returned true, so grouping does not weaken throttling.
+     *
+     * The default BeginFailureRecordTransaction returns false, in which case each
+     * write must be durable by the time it returns.
+     *
+     * Returns true if the staged updates were persisted.
      */
-    virtual uint32_t ComputeRetryTimeout(const failure_record_t *record);
+    virtual bool BeginFailureRecordTransaction() { return false; }
+    virtual bool CommitFailureRecordTransaction() { return true; }
 
     /**
-     * Returns whether the GateKeeper implementation is backed by hardware.
+     * Optional asynchronous commit used by VerifyAsync in place of
+     * CommitFailureRecordTransaction. Returns true if the commit of the
+     * current transaction was started, in which case the implementation
+     * must call CompleteVerifyAsync with its outcome once it finishes, but
+     * not from within this call. The default returns false, so VerifyAsync
+     * commits synchronously.
      */
-    virtual bool IsHardwareBacked() const = 0;
+    virtual bool StartFailureRecordCommit() { return false; }
 
     /**
-     * Verifies that handle matches password HMAC'ed with the password_key
+     * Per-user locking used once EnableConcurrentRequests has been called:
+     * GateKeeper brackets every sequence of failure record accesses for uid
+     * with LockUser and UnlockUser, holding at most one user's lock at a
+     * time. A software implementation would typically map uid onto a small
+     * array of mutexes. The defaults do nothing.
      */
-    virtual bool DoVerify(const password_handle_t *expected_handle, const SizedBuffer &password);
+    virtual void LockUser(uint32_t) {}
+    virtual void UnlockUser(uint32_t) {}
 
-private:
     /**
-     * Generates a signed attestation of an authentication event and assings
-     * to auth_token UniquePtr.
-     * The format is consistent with that of hw_auth_token_t.
-     * Also returns the length in length if it is not null.
+     * Computes the amount of time to throttle the user due to the current failure_record
+     * counter. The generic GateKeeper looks the counter up in the throttle schedule;
+     * prefer SetThrottleSchedule to overriding this.
      */
-    void MintAuthToken(UniquePtr<uint8_t> *auth_token, uint32_t *length, uint64_t timestamp,
-            secure_id_t user_id, secure_id_t authenticator_id, uint64_t challenge);
+    virtual uint32_t ComputeRetryTimeout(const failure_record_t *record) {
+        return GateKeeperT<GateKeeper>::ComputeRetryTimeout(record);
+    }
 
     /**
-     * Populates password_handle with the data provided and computes HMAC.
+     * Returns whether the GateKeeper implementation is backed by hardware.
      */
-    bool CreatePasswordHandle(SizedBuffer *password_handle, salt_t salt,
-            secure_id_t secure_id, secure_id_t authenticator_id, uint8_t handle_version,
-            const uint8_t *password, uint32_t password_length);
+    virtual bool IsHardwareBacked() const = 0;
 
     /**
-     * Increments the counter on the current failure record for the provided user id.
-     * Sets the last_checked_timestamp to timestamp. Writes the updated record
-     * to *record if not null.
+     * Optional KDF stage applied to the password before it is signed, so that
+     * the brute force cost of a handle is set by parameters recorded in it.
      *
-     * Returns true if failure record was successfully incremented.
+     * GetPasswordKdfParams writes the parameters for new enrollments to params.
+     * The default returns false, in which case new handles are enrolled without
+     * a KDF stage at HANDLE_VERSION_THROTTLE. Verifying a handle whose
+     * parameters differ from the current ones sets request_reenroll, so that
+     * handles migrate as their passwords are next entered.
+     *
+     * DerivePassword writes the derived_length size output of the KDF described
+     * by params to derived. Returns false if the parameters are not supported.
      */
-    bool IncrementFailureRecord(uint32_t uid, secure_id_t user_id, uint64_t timestamp,
-            failure_record_t *record, bool secure);
+    virtual bool GetPasswordKdfParams(password_kdf_params_t * /* params */) const {
+        return false;
+    }
+    virtual bool DerivePassword(uint8_t * /* derived */, uint32_t /* derived_length */,
+            const password_kdf_params_t * /* params */, const uint8_t * /* password */,
+            uint32_t /* password_length */, salt_t /* salt */) {
+        return false;
+    }
 
     /**
-     * Determines whether the request is within the current throttle window.
-     *
-     * If the system timer has been reset due to a reboot or otherwise, resets
-     * the throttle window with a base at the current time.
-     *
-     * Returns true if the request is in the throttle window.
+     * Verifies that handle matches password HMAC'ed with the password_key
      */
-    bool ThrottleRequest(uint32_t uid, uint64_t timestamp,
-            failure_record_t *record, bool secure, GateKeeperMessage *response);
+    virtual bool DoVerify(const password_handle_t *expected_handle, const SizedBuffer &password) {
+        return GateKeeperT<GateKeeper>::DoVerify(expected_handle, password);
+    }
+
 };
 
+extern template class GateKeeperT<GateKeeper>;
+
 }
 
 #endif // GATEKEEPER_H_
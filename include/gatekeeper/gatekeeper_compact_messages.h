@@ -0,0 +1,145 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GATEKEEPER_COMPACT_MESSAGES_H_
+#define GATEKEEPER_COMPACT_MESSAGES_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <hardware/hw_auth_token.h>
+
+#include "gatekeeper_messages.h"
+#include "password_handle.h"
+
+/**
+ * Compact storage for the enroll and verify messages, for implementations
+ * that keep a request and its response per session, e.g. a TA.
+ *
+ * Each buffer is stored inline, next to its length, when it fits: sized for
+ * a current password handle, an auth token and passwords of up to
+ * COMPACT_PASSWORD_INLINE_LENGTH bytes. Longer values, which are rare, fall
+ * back to a heap copy. The structs hold passwords and wipe them, inline or
+ * not, when destroyed.
+ *
+ * CompactMessage copies a message into its compact form. ExpandMessage
+ * turns it back into a message whose buffers are views of the compact
+ * storage, ready to be handed to GateKeeper or serialized without
+ * allocating.
+ */
+namespace gatekeeper {
+
+const uint32_t COMPACT_PASSWORD_INLINE_LENGTH = 64;
+
+/**
+ * One buffer of a compact message: inline if it fits in Capacity bytes,
+ * otherwise in overflow.
+ */
+template <uint32_t Capacity>
+struct compact_buffer_t {
+    compact_buffer_t() : length(0) {
+        memset(data, 0, sizeof(data));
+    }
+
+    ~compact_buffer_t() {
+        Clear();
+        overflow.Release();
+    }
+
+    /**
+     * Wipes the contents, keeping any heap memory for the next value.
+     */
+    void Clear() {
+        memset_s(data, 0, sizeof(data));
+        overflow.Clear();
+        length = 0;
+    }
+
+    // 0 if there is no such buffer
+    uint32_t length;
+    uint8_t data[Capacity];
+    // holds values longer than Capacity
+    SizedBuffer overflow;
+};
+
+struct compact_enroll_request_t {
+    uint32_t user_id;
+    compact_buffer_t<sizeof(password_handle_t)> password_handle;
+    compact_buffer_t<COMPACT_PASSWORD_INLINE_LENGTH> enrolled_password;
+    compact_buffer_t<COMPACT_PASSWORD_INLINE_LENGTH> provided_password;
+};
+
+struct compact_enroll_response_t {
+    uint32_t error;
+    uint32_t user_id;
+    uint32_t retry_timeout;
+    compact_buffer_t<sizeof(password_handle_t)> enrolled_password_handle;
+};
+
+struct compact_verify_request_t {
+    uint64_t challenge;
+    uint32_t user_id;
+    compact_buffer_t<sizeof(password_handle_t)> password_handle;
+    compact_buffer_t<COMPACT_PASSWORD_INLINE_LENGTH> provided_password;
+};
+
+struct compact_verify_response_t {
+    uint32_t error;
+    uint32_t user_id;
+    uint32_t retry_timeout;
+    compact_buffer_t<sizeof(hw_auth_token_t)> auth_token;
+    uint8_t request_reenroll;
+};
+
+/**
+ * Memory a session keeping one request and its response in compact form
+ * needs when every buffer fits inline, to size TA heaps with.
+ */
+const uint32_t COMPACT_ENROLL_SESSION_SIZE =
+        sizeof(compact_enroll_request_t) + sizeof(compact_enroll_response_t);
+const uint32_t COMPACT_VERIFY_SESSION_SIZE =
+        sizeof(compact_verify_request_t) + sizeof(compact_verify_response_t);
+
+/**
+ * Copies message into compact, replacing and wiping what compact held.
+ * Buffers too long to be stored inline are copied to the heap. Returns
+ * ERROR_NONE.
+ */
+gatekeeper_error_t CompactMessage(const EnrollRequest &message, compact_enroll_request_t *compact);
+gatekeeper_error_t CompactMessage(const EnrollResponse &message,
+        compact_enroll_response_t *compact);
+gatekeeper_error_t CompactMessage(const VerifyRequest &message, compact_verify_request_t *compact);
+gatekeeper_error_t CompactMessage(const VerifyResponse &message,
+        compact_verify_response_t *compact);
+
+/**
+ * Replaces the contents of message with those of compact. Its buffers become
+ * read-only views of the inline storage, so compact must outlive message and
+ * stay in place. Returns ERROR_INVALID, with message reset, if a stored
+ * length doesn't match its storage, i.e. compact is corrupt. Unknown error
+ * codes expand to ERROR_UNKNOWN.
+ */
+gatekeeper_error_t ExpandMessage(const compact_enroll_request_t &compact,
+        EnrollRequest *message);
+gatekeeper_error_t ExpandMessage(const compact_enroll_response_t &compact,
+        EnrollResponse *message);
+gatekeeper_error_t ExpandMessage(const compact_verify_request_t &compact,
+        VerifyRequest *message);
+gatekeeper_error_t ExpandMessage(const compact_verify_response_t &compact,
+        VerifyResponse *message);
+
+}
+
+#endif // GATEKEEPER_COMPACT_MESSAGES_H_
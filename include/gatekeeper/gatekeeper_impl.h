@@ -0,0 +1,1211 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_IMPL_H_
+#define GATEKEEPER_IMPL_H_
+
+/*
+ * Member definitions of GateKeeperT. Included by gatekeeper.cpp to
+ * instantiate the virtual GateKeeper, and by implementations that
+ * instantiate GateKeeperT for their own statically dispatched Platform.
+ */
+
+#include <endian.h>
+
+#include "gatekeeper.h"
+
+namespace gatekeeper {
+
+// Number of users whose failure record state is tracked by fast verification
+#define FAST_VERIFY_ENTRIES 8
+
+// Shortest derivation CalibratePasswordKdf extrapolates from
+#define KDF_CALIBRATION_MIN_SAMPLE_MS 16
+#define VERIFY_CACHE_ENTRIES 4
+
+// Layout of failure_record_t::last_checked_timestamp: milliseconds since boot
+// in the low BOOT_SESSION_SHIFT bits, boot session tag above them
+#define BOOT_SESSION_SHIFT 44
+#define BOOT_SESSION_TAGS ((1u << (64 - BOOT_SESSION_SHIFT)) - 1)
+#define BOOT_TIMESTAMP_MASK ((UINT64_C(1) << BOOT_SESSION_SHIFT) - 1)
+
+// Number of users whose throttle window restart after a reboot is kept in memory
+#define BOOT_ANCHOR_ENTRIES 8
+
+// Enrollments of an EnrollBatch sharing a random draw and a failure record transaction
+#define ENROLL_BATCH_CHUNK 8
+
+
+template <typename Platform>
+void GateKeeperT<Platform>::Enroll(const EnrollRequest &request, EnrollResponse *response) {
+    if (response == NULL) return;
+
+    EnrollBatch(&request, 1, response);
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::EnrollBatch(const EnrollRequest *requests, size_t count,
+        EnrollResponse *responses) {
+    if (requests == NULL || responses == NULL) return;
+    ResetResponses(responses, count);
+    if (FailIfAsyncPending(responses, count)) return;
+
+    Count(&gatekeeper_stats_t::enroll_requests, count);
+    TraceBegin(PHASE_ENROLL);
+    if (concurrent_) {
+        // One lock held at a time, so requests of a batch can't deadlock each other
+        for (size_t i = 0; i < count; i++) {
+            platform()->LockUser(requests[i].user_id);
+            DropVerifyCacheEntries(requests[i].user_id);
+            EnrollBatchInternal(&requests[i], 1, &responses[i]);
+            platform()->UnlockUser(requests[i].user_id);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) DropVerifyCacheEntries(requests[i].user_id);
+        EnrollBatchInternal(requests, count, responses);
+    }
+    TraceEnd(PHASE_ENROLL);
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::EnrollBatchInternal(const EnrollRequest *requests, size_t count,
+        EnrollResponse *responses) {
+    uint64_t timestamp = platform()->GetMillisecondsSinceBoot();
+
+    // As in VerifyBatchInternal, charge every old password check with a
+    // failure before checking any of them
+    bool transaction = platform()->BeginFailureRecordTransaction();
+    bool pending = false;
+    for (size_t i = 0; i < count; i++) {
+        if (BeginEnroll(requests[i], timestamp, &responses[i])) pending = true;
+    }
+
+    if (transaction && !CommitFailureRecords()) {
+        FailUncommitted(responses, count);
+        return;
+    }
+
+    if (pending) FinishEnrollBatch(requests, count, responses);
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::BeginEnroll(const EnrollRequest &request, uint64_t timestamp,
+        EnrollResponse *response) {
+    if (!request.provided_password.Data()) {
+        response->error = ERROR_INVALID;
+        return false;
+    }
+
+    response->retry_timeout = 0;
+    // Password handle does not match what is stored, a new SecureID is generated
+    if (request.password_handle.Data() == NULL) return true;
+
+    if (!PasswordHandleWellFormed(request.password_handle)) {
+        response->error = ERROR_INVALID_HANDLE;
+        return false;
+    }
+
+    const password_handle_t *pw_handle =
+        reinterpret_cast<const password_handle_t *>(request.password_handle.Data());
+    if (pw_handle->version < HANDLE_VERSION_THROTTLE) return true;
+
+    uint32_t uid = request.user_id;
+    secure_id_t user_id = pw_handle->user_id;
+    bool throttle_secure = pw_handle->flags & HANDLE_FLAG_THROTTLE_SECURE;
+    failure_record_t record;
+    TraceBegin(PHASE_GET_FAILURE_RECORD);
+    bool have_record = platform()->GetFailureRecord(uid, user_id, &record, throttle_secure);
+    TraceEnd(PHASE_GET_FAILURE_RECORD);
+    if (!have_record) {
+        response->error = ERROR_UNKNOWN;
+        return false;
+    }
+
+    if (ThrottleRequest(uid, timestamp, &record, throttle_secure, response)) return false;
+
+    if (!IncrementFailureRecord(uid, user_id, timestamp, &record, throttle_secure)) {
+        response->error = ERROR_UNKNOWN;
+        return false;
+    }
+
+    response->retry_timeout = platform()->ComputeRetryTimeout(&record);
+    return true;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::FinishEnrollBatch(const EnrollRequest *requests, size_t count,
+        EnrollResponse *responses) {
+    // Concurrent requests each fetch the password key in CreatePasswordHandle
+    if (!concurrent_) {
+        platform()->GetPasswordKey(&batch_password_key_, &batch_password_key_length_);
+    }
+
+    password_kdf_params_t kdf_params;
+    bool kdf = platform()->GetPasswordKdfParams(&kdf_params);
+    for (size_t first = 0; first < count; first += ENROLL_BATCH_CHUNK) {
+        size_t chunk = count - first < ENROLL_BATCH_CHUNK ? count - first : ENROLL_BATCH_CHUNK;
+        FinishEnrollChunk(&requests[first], chunk, &responses[first], kdf ? &kdf_params : NULL);
+    }
+
+    if (!concurrent_) {
+        batch_password_key_ = NULL;
+        batch_password_key_length_ = 0;
+    }
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::FinishEnrollChunk(const EnrollRequest *requests, size_t count,
+        EnrollResponse *responses, const password_kdf_params_t *kdf_params) {
+    bool pending = false;
+    for (size_t i = 0; i < count; i++) {
+        EnrollResponse *response = &responses[i];
+        if (response->error != ERROR_NONE) continue;
+
+        uint32_t timeout = response->retry_timeout;
+        response->retry_timeout = 0;
+        const password_handle_t *pw_handle =
+            reinterpret_cast<const password_handle_t *>(requests[i].password_handle.Data());
+        if (pw_handle != NULL && !platform()->DoVerify(pw_handle, requests[i].enrolled_password)) {
+            // incorrect old password, timeout was computed from the incremented record
+            if (timeout > 0) {
+                response->SetRetryTimeout(timeout);
+            } else {
+                response->error = ERROR_INVALID;
+            }
+            continue;
+        }
+        pending = true;
+    }
+    if (!pending) return;
+
+    // A single draw covers the new secure ids and salts of the chunk
+    struct {
+        secure_id_t user_id;
+        salt_t salt;
+    } random[ENROLL_BATCH_CHUNK];
+    DrawRandom(random, sizeof(random[0]) * count);
+
+    uint64_t flags[ENROLL_BATCH_CHUNK];
+    bool transaction = platform()->BeginFailureRecordTransaction();
+    TraceBegin(PHASE_CLEAR_FAILURE_RECORD);
+    for (size_t i = 0; i < count; i++) {
+        if (responses[i].error != ERROR_NONE) continue;
+
+        const password_handle_t *pw_handle =
+            reinterpret_cast<const password_handle_t *>(requests[i].password_handle.Data());
+        if (pw_handle != NULL) random[i].user_id = pw_handle->user_id;
+
+        uint32_t uid = requests[i].user_id;
+        secure_id_t user_id = random[i].user_id;
+        flags[i] = 0;
+        if (platform()->ClearFailureRecord(uid, user_id, true)) {
+            flags[i] |= HANDLE_FLAG_THROTTLE_SECURE;
+        } else {
+            platform()->ClearFailureRecord(uid, user_id, false);
+        }
+        SetFastVerifyState(uid, user_id, FAST_VERIFY_NONE);
+    }
+    TraceEnd(PHASE_CLEAR_FAILURE_RECORD);
+
+    if (transaction && !CommitFailureRecords()) {
+        // the old handles stay valid, don't hand out new ones over uncleared records
+        for (size_t i = 0; i < count; i++) {
+            if (responses[i].error == ERROR_NONE) responses[i].error = ERROR_UNKNOWN;
+        }
+        memset_s(random, 0, sizeof(random));
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        EnrollResponse *response = &responses[i];
+        if (response->error != ERROR_NONE) continue;
+
+        // Written in place, so a reused response keeps its buffer
+        SizedBuffer &password_handle = response->enrolled_password_handle;
+        password_handle.Allocate(
+                kdf_params != NULL ? sizeof(password_handle_t) : HANDLE_LENGTH_MIN,
+                response->arena);
+        if (!CreatePasswordHandle(
+                reinterpret_cast<password_handle_t *>(password_handle.MutableData()),
+                random[i].salt, random[i].user_id, flags[i],
+                kdf_params != NULL ? HANDLE_VERSION_KDF : HANDLE_VERSION_THROTTLE, kdf_params,
+                requests[i].provided_password.Data(), requests[i].provided_password.length)) {
+            password_handle.Clear();
+            response->error = ERROR_INVALID;
+        }
+    }
+    memset_s(random, 0, sizeof(random));
+}
+
+template <typename Platform>
+uint32_t GateKeeperT<Platform>::HandleMessage(uint32_t cmd, const uint8_t *in,
+        uint32_t in_length, uint8_t *out, uint32_t out_capacity) {
+    switch (cmd) {
+    case ENROLL:
+        return HandleRequest(&GateKeeperT::Enroll, in, in_length, out, out_capacity);
+    case VERIFY:
+        return HandleRequest(&GateKeeperT::Verify, in, in_length, out, out_capacity);
+    case GET_STATS:
+        return HandleRequest(&GateKeeperT::GetStats, in, in_length, out, out_capacity);
+    default:
+        return 0;
+    }
+}
+
+// Room for the largest buffer a response carries, plus Arena alignment
+#define HANDLE_MESSAGE_ARENA_SIZE (sizeof(password_handle_t) + sizeof(hw_auth_token_t) + 16)
+
+template <typename Platform>
+template <typename Request, typename Response>
+uint32_t GateKeeperT<Platform>::HandleRequest(
+        void (GateKeeperT::*handler)(const Request &, Response *), const uint8_t *in,
+        uint32_t in_length, uint8_t *out, uint32_t out_capacity) {
+    uint8_t scratch[HANDLE_MESSAGE_ARENA_SIZE] __attribute__((aligned(8)));
+    Arena arena(scratch, sizeof(scratch));
+
+    Request request;
+    Response response;
+    response.arena = &arena;
+    request.user_id = 0;
+
+    gatekeeper_error_t error = ERROR_INVALID;
+    if (in != NULL) error = request.DeserializeView(in, in + in_length);
+    response.user_id = request.user_id;
+    if (error == ERROR_NONE) {
+        (this->*handler)(request, &response);
+    } else {
+        response.error = ERROR_INVALID;
+    }
+
+    return response.SerializeInto(out, out_capacity);
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::Verify(const VerifyRequest &request, VerifyResponse *response) {
+    if (response == NULL) return;
+
+    VerifyBatch(&request, 1, response);
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::VerifyBatch(const VerifyRequest *requests, size_t count,
+        VerifyResponse *responses) {
+    if (requests == NULL || responses == NULL) return;
+    ResetResponses(responses, count);
+    if (FailIfAsyncPending(responses, count)) return;
+
+    Count(&gatekeeper_stats_t::verify_requests, count);
+    TraceBegin(PHASE_VERIFY);
+    if (concurrent_) {
+        // One lock held at a time, so requests of a batch can't deadlock each other
+        for (size_t i = 0; i < count; i++) {
+            platform()->LockUser(requests[i].user_id);
+            VerifyBatchInternal(&requests[i], 1, &responses[i]);
+            platform()->UnlockUser(requests[i].user_id);
+        }
+    } else {
+        VerifyBatchInternal(requests, count, responses);
+    }
+    TraceEnd(PHASE_VERIFY);
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::VerifyAsync(const VerifyRequest &request,
+        VerifyResponse *response) {
+    if (response == NULL) return true;
+    if (concurrent_) {
+        Verify(request, response);
+        return true;
+    }
+    ResetResponses(response, 1);
+    if (FailIfAsyncPending(response, 1)) return true;
+
+    Count(&gatekeeper_stats_t::verify_requests);
+    TraceBegin(PHASE_VERIFY);
+    uint64_t timestamp = platform()->GetMillisecondsSinceBoot();
+    bool transaction = platform()->BeginFailureRecordTransaction();
+    bool pending = BeginVerify(request, timestamp, response);
+    if (transaction && pending && platform()->StartFailureRecordCommit()) {
+        // The increment is in flight: check the password meanwhile, but leave
+        // the response untouched until CompleteVerifyAsync reports it durable
+        const password_handle_t *password_handle =
+                reinterpret_cast<const password_handle_t *>(request.password_handle.Data());
+        platform()->GetPasswordKey(&batch_password_key_, &batch_password_key_length_);
+        async_matched_ = CheckPassword(request.user_id, password_handle,
+                request.provided_password, timestamp);
+        batch_password_key_ = NULL;
+        batch_password_key_length_ = 0;
+
+        async_request_ = &request;
+        async_response_ = response;
+        async_timestamp_ = timestamp;
+        // PHASE_VERIFY stays open until CompleteVerifyAsync
+        return false;
+    }
+
+    if (transaction && !CommitFailureRecords()) {
+        FailUncommitted(response, 1);
+    } else if (pending) {
+        FinishVerifyBatch(&request, 1, response, timestamp, NULL);
+    }
+    TraceEnd(PHASE_VERIFY);
+    return true;
+}
+
+template <typename Platform>
+VerifyResponse *GateKeeperT<Platform>::CompleteVerifyAsync(bool committed) {
+    VerifyResponse *response = async_response_;
+    if (response == NULL) return NULL;
+
+    const VerifyRequest *request = async_request_;
+    bool matched = async_matched_;
+    async_request_ = NULL;
+    async_response_ = NULL;
+    async_matched_ = false;
+
+    if (committed) {
+        FinishVerifyBatch(request, 1, response, async_timestamp_, &matched);
+    } else {
+        FailUncommitted(response, 1);
+    }
+    TraceEnd(PHASE_VERIFY);
+    return response;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::VerifyBatchInternal(const VerifyRequest *requests, size_t count,
+        VerifyResponse *responses) {
+    uint64_t timestamp = platform()->GetMillisecondsSinceBoot();
+
+    // Charge every throttled request with a failure before checking any password,
+    // so the failure record I/O for the whole batch happens back to back.
+    bool transaction = platform()->BeginFailureRecordTransaction();
+    bool pending = false;
+    for (size_t i = 0; i < count; i++) {
+        if (BeginVerify(requests[i], timestamp, &responses[i])) pending = true;
+    }
+
+    if (transaction && !CommitFailureRecords()) {
+        FailUncommitted(responses, count);
+        return;
+    }
+
+    if (pending) FinishVerifyBatch(requests, count, responses, timestamp, NULL);
+}
+
+template <typename Platform>
+template <typename Response>
+void GateKeeperT<Platform>::FailUncommitted(Response *responses, size_t count) {
+    // None of the increments are known to be durable, so no password may be checked
+    for (size_t i = 0; i < count; i++) {
+        if (responses[i].error == ERROR_NONE || responses[i].error == ERROR_RETRY) {
+            responses[i].error = ERROR_UNKNOWN;
+        }
+    }
+}
+
+template <typename Platform>
+template <typename Response>
+void GateKeeperT<Platform>::ResetResponses(Response *responses, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        responses[i].error = ERROR_NONE;
+        responses[i].retry_timeout = 0;
+        responses[i].nonErrorReset();
+    }
+}
+
+template <typename Platform>
+template <typename Response>
+bool GateKeeperT<Platform>::FailIfAsyncPending(Response *responses, size_t count) {
+    if (async_response_ == NULL) return false;
+
+    for (size_t i = 0; i < count; i++) responses[i].error = ERROR_UNKNOWN;
+    return true;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::FinishVerifyBatch(const VerifyRequest *requests, size_t count,
+        VerifyResponse *responses, uint64_t timestamp, const bool *matched) {
+    // Concurrent requests each fetch the password key in CreatePasswordHandle,
+    // and with the outcomes already known no password is checked at all
+    bool fetch_password_key = !concurrent_ && matched == NULL;
+    if (fetch_password_key) {
+        platform()->GetPasswordKey(&batch_password_key_, &batch_password_key_length_);
+    }
+
+    const uint8_t *auth_token_key = NULL;
+    uint32_t auth_token_key_length = 0;
+    bool auth_token_key_fetched = false;
+    bool transaction = platform()->BeginFailureRecordTransaction();
+    for (size_t i = 0; i < count; i++) {
+        VerifyResponse *response = &responses[i];
+        if (response->error != ERROR_NONE) continue;
+
+        const password_handle_t *password_handle = reinterpret_cast<const password_handle_t *>(
+                requests[i].password_handle.Data());
+        bool throttle = (password_handle->version >= HANDLE_VERSION_THROTTLE);
+        uint32_t timeout = response->retry_timeout;
+        response->retry_timeout = 0;
+
+        uint32_t uid = requests[i].user_id;
+        secure_id_t user_id = password_handle->user_id;
+        bool match = matched != NULL ? matched[i]
+                : CheckPassword(uid, password_handle, requests[i].provided_password, timestamp);
+        if (!match) {
+            SetFastVerifyState(uid, user_id, FAST_VERIFY_NONE);
+            Count(&gatekeeper_stats_t::verify_failures);
+            // timeout was computed from the incremented record by BeginVerify
+            if (throttle && timeout > 0) {
+                Count(&gatekeeper_stats_t::retry_timeouts);
+                response->SetRetryTimeout(timeout);
+            } else {
+                response->error = ERROR_INVALID;
+            }
+            continue;
+        }
+
+        Count(&gatekeeper_stats_t::verify_successes);
+
+        // Signature matches. The auth token key is only fetched once, and only
+        // if some request in the batch actually needs a token.
+        if (!auth_token_key_fetched) {
+            if (!AcquireAuthTokenKey(&auth_token_key, &auth_token_key_length)) {
+                auth_token_key = NULL;
+                auth_token_key_length = 0;
+            }
+            auth_token_key_fetched = true;
+        }
+
+        secure_id_t authenticator_id = 0;
+        // The token is signed in place in the response's buffer
+        SizedBuffer &auth_token = response->auth_token;
+        auth_token.Allocate(sizeof(hw_auth_token_t), response->arena);
+        TraceBegin(PHASE_MINT_AUTH_TOKEN);
+        MintAuthToken(reinterpret_cast<hw_auth_token_t *>(auth_token.MutableData()), timestamp,
+                user_id, authenticator_id, requests[i].challenge,
+                auth_token_key, auth_token_key_length);
+        TraceEnd(PHASE_MINT_AUTH_TOKEN);
+        if (throttle) {
+            if (GetFastVerifyState(uid, user_id) == FAST_VERIFY_PENDING) {
+                // the only failure counted is this attempt, leave it for the next one to ignore
+                SetFastVerifyState(uid, user_id, FAST_VERIFY_CLEAN);
+            } else {
+                bool throttle_secure = password_handle->flags & HANDLE_FLAG_THROTTLE_SECURE;
+                TraceBegin(PHASE_CLEAR_FAILURE_RECORD);
+                platform()->ClearFailureRecord(uid, user_id, throttle_secure);
+                TraceEnd(PHASE_CLEAR_FAILURE_RECORD);
+            }
+        }
+    }
+    if (transaction) CommitFailureRecords();
+
+    if (fetch_password_key) {
+        batch_password_key_ = NULL;
+        batch_password_key_length_ = 0;
+    }
+    ReleaseAuthTokenKey(auth_token_key, auth_token_key_length);
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::AcquireAuthTokenKey(const uint8_t **auth_token_key, uint32_t *length) {
+    if (!cache_auth_token_key_ || concurrent_) {
+        return platform()->GetAuthTokenKey(auth_token_key, length);
+    }
+
+    // Read before fetching, so that an invalidation racing with the fetch
+    // leaves the new copy tagged as stale rather than current.
+    uint32_t epoch = __atomic_load_n(&auth_token_key_epoch_, __ATOMIC_ACQUIRE);
+    if (cached_auth_token_key_.get() == NULL || cached_auth_token_key_epoch_ != epoch) {
+        DropCachedAuthTokenKey();
+        const uint8_t *key = NULL;
+        uint32_t key_length = 0;
+        if (!platform()->GetAuthTokenKey(&key, &key_length) || key == NULL) return false;
+        cached_auth_token_key_.reset(const_cast<uint8_t *>(key));
+        cached_auth_token_key_length_ = key_length;
+        cached_auth_token_key_epoch_ = epoch;
+    }
+
+    *auth_token_key = cached_auth_token_key_.get();
+    *length = cached_auth_token_key_length_;
+    return true;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::ReleaseAuthTokenKey(const uint8_t *auth_token_key, uint32_t length) {
+    if (auth_token_key == NULL || auth_token_key == cached_auth_token_key_.get()) return;
+    memset_s(const_cast<uint8_t *>(auth_token_key), 0, length);
+    delete[] auth_token_key;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::DropCachedAuthTokenKey() {
+    if (cached_auth_token_key_.get() == NULL) return;
+    memset_s(cached_auth_token_key_.get(), 0, cached_auth_token_key_length_);
+    cached_auth_token_key_.reset();
+    cached_auth_token_key_length_ = 0;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::GetStats(const GetStatsRequest &request, GetStatsResponse *response) {
+    if (response == NULL) return;
+
+    response->user_id = request.user_id;
+    if (!concurrent_) {
+        response->stats = stats_;
+        return;
+    }
+
+    uint32_t snapshot[sizeof(stats_) / sizeof(uint32_t)];
+    const uint32_t *counters = reinterpret_cast<const uint32_t *>(&stats_);
+    for (size_t i = 0; i < sizeof(snapshot) / sizeof(snapshot[0]); i++) {
+        snapshot[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+    memcpy(&response->stats, snapshot, sizeof(snapshot));
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::BeginVerify(const VerifyRequest &request, uint64_t timestamp,
+        VerifyResponse *response) {
+    if (!request.provided_password.Data() || !request.password_handle.Data()) {
+        response->error = ERROR_INVALID;
+        return false;
+    }
+
+    if (!PasswordHandleWellFormed(request.password_handle)) {
+        response->error = ERROR_INVALID_HANDLE;
+        return false;
+    }
+
+    const password_handle_t *password_handle = reinterpret_cast<const password_handle_t *>(
+            request.password_handle.Data());
+
+    secure_id_t user_id = password_handle->user_id;
+    uint32_t uid = request.user_id;
+
+    uint32_t timeout = 0;
+    bool throttle = (password_handle->version >= HANDLE_VERSION_THROTTLE);
+    bool throttle_secure = password_handle->flags & HANDLE_FLAG_THROTTLE_SECURE;
+    if (throttle) {
+        failure_record_t record;
+        TraceBegin(PHASE_GET_FAILURE_RECORD);
+        bool have_record = platform()->GetFailureRecord(uid, user_id, &record, throttle_secure);
+        TraceEnd(PHASE_GET_FAILURE_RECORD);
+        if (!have_record) {
+            response->error = ERROR_UNKNOWN;
+            return false;
+        }
+
+        if (GetFastVerifyState(uid, user_id) == FAST_VERIFY_CLEAN) {
+            // the stored count was left behind by a successful attempt
+            record.failure_counter = 0;
+        }
+
+        if (ThrottleRequest(uid, timestamp, &record, throttle_secure, response)) return false;
+
+        SetFastVerifyState(uid, user_id,
+                record.failure_counter == 0 ? FAST_VERIFY_PENDING : FAST_VERIFY_NONE);
+        if (!IncrementFailureRecord(uid, user_id, timestamp, &record, throttle_secure)) {
+            SetFastVerifyState(uid, user_id, FAST_VERIFY_NONE);
+            response->error = ERROR_UNKNOWN;
+            return false;
+        }
+
+        timeout = platform()->ComputeRetryTimeout(&record);
+    }
+
+    if (!throttle || PasswordKdfOutdated(password_handle)) {
+        Count(&gatekeeper_stats_t::reenroll_requested);
+        response->request_reenroll = true;
+    }
+
+    response->retry_timeout = timeout;
+    return true;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::CreatePasswordHandle(password_handle_t *password_handle, salt_t salt,
+        secure_id_t user_id, uint64_t flags, uint8_t handle_version,
+        const password_kdf_params_t *kdf_params, const uint8_t *password,
+        uint32_t password_length) {
+    password_handle->version = handle_version;
+    password_handle->salt = salt;
+    password_handle->user_id = user_id;
+    password_handle->flags = flags;
+    password_handle->hardware_backed = platform()->IsHardwareBacked();
+
+    bool kdf = handle_version >= HANDLE_VERSION_KDF;
+    uint32_t kdf_params_length = 0;
+    if (kdf) {
+        if (kdf_params == NULL) return false;
+        password_handle->kdf = *kdf_params;
+        kdf_params_length = sizeof(password_handle->kdf);
+    }
+
+    const uint8_t *password_key = batch_password_key_;
+    uint32_t password_key_length = batch_password_key_length_;
+    if (password_key == NULL) {
+        platform()->GetPasswordKey(&password_key, &password_key_length);
+    }
+
+    if (!password_key || password_key_length == 0) {
+        return false;
+    }
+
+    // With a KDF stage the derived password is signed in place of the password
+    uint8_t derived[PASSWORD_KDF_OUTPUT_LENGTH];
+    if (kdf) {
+        TraceBegin(PHASE_PASSWORD_KDF);
+        bool derived_ok = platform()->DerivePassword(derived, sizeof(derived),
+                &password_handle->kdf, password, password_length, salt);
+        TraceEnd(PHASE_PASSWORD_KDF);
+        if (!derived_ok) {
+            memset_s(derived, 0, sizeof(derived));
+            return false;
+        }
+        password = derived;
+        password_length = sizeof(derived);
+    }
+
+    uint32_t metadata_length = sizeof(user_id) + sizeof(flags) + sizeof(HANDLE_VERSION);
+    TraceBegin(PHASE_PASSWORD_SIGNATURE);
+    const uint8_t *prepared_key = GetPreparedPasswordKey(password_key, password_key_length);
+    bool streaming = true;
+    if (prepared_key != NULL) {
+        platform()->BeginPreparedPasswordSignature(prepared_key, prepared_password_key_length_,
+                salt);
+    } else {
+        streaming = platform()->BeginPasswordSignature(password_key, password_key_length, salt);
+    }
+
+    if (streaming) {
+        platform()->UpdatePasswordSignature(reinterpret_cast<const uint8_t *>(password_handle),
+                metadata_length);
+        if (kdf) {
+            platform()->UpdatePasswordSignature(
+                    reinterpret_cast<const uint8_t *>(&password_handle->kdf), kdf_params_length);
+        }
+        platform()->UpdatePasswordSignature(password, password_length);
+        platform()->FinishPasswordSignature(password_handle->signature,
+                sizeof(password_handle->signature));
+    } else {
+        uint8_t to_sign[metadata_length + kdf_params_length + password_length];
+        memcpy(to_sign, password_handle, metadata_length);
+        memcpy(to_sign + metadata_length, &password_handle->kdf, kdf_params_length);
+        memcpy(to_sign + metadata_length + kdf_params_length, password, password_length);
+
+        platform()->ComputePasswordSignature(password_handle->signature,
+                sizeof(password_handle->signature), password_key, password_key_length, to_sign,
+                sizeof(to_sign), salt);
+        memset_s(to_sign, 0, sizeof(to_sign));
+    }
+    TraceEnd(PHASE_PASSWORD_SIGNATURE);
+    memset_s(derived, 0, sizeof(derived));
+    return true;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::PasswordKdfOutdated(const password_handle_t *password_handle) const {
+    password_kdf_params_t current;
+    if (!platform()->GetPasswordKdfParams(&current)) return false;
+    if (password_handle->version < HANDLE_VERSION_KDF) return true;
+    return memcmp(&password_handle->kdf, &current, sizeof(current)) != 0;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::CalibratePasswordKdf(uint32_t target_ms,
+        password_kdf_params_t *params) {
+    if (params == NULL || target_ms == 0) return false;
+    if (params->cost == 0) params->cost = 1;
+
+    // Double the cost until a derivation is long enough to time with a
+    // millisecond clock, then scale it linearly to the target.
+    uint64_t sample_ms = target_ms / 4;
+    if (sample_ms < KDF_CALIBRATION_MIN_SAMPLE_MS) {
+        sample_ms = target_ms < KDF_CALIBRATION_MIN_SAMPLE_MS ?
+                target_ms : KDF_CALIBRATION_MIN_SAMPLE_MS;
+    }
+
+    static const uint8_t probe[] = "gatekeeper kdf calibration";
+    uint8_t derived[PASSWORD_KDF_OUTPUT_LENGTH];
+    uint64_t elapsed;
+    for (;;) {
+        uint64_t start = platform()->GetMillisecondsSinceBoot();
+        bool derived_ok = platform()->DerivePassword(derived, sizeof(derived), params, probe,
+                sizeof(probe), 0);
+        elapsed = platform()->GetMillisecondsSinceBoot() - start;
+        if (!derived_ok) return false;
+        if (elapsed >= sample_ms) break;
+        if (params->cost > UINT32_MAX / 2) return false;
+        params->cost *= 2;
+    }
+    memset_s(derived, 0, sizeof(derived));
+
+    uint64_t cost = (uint64_t) params->cost * target_ms / elapsed;
+    if (cost == 0) cost = 1;
+    if (cost > UINT32_MAX) return false;
+    if (params->algorithm == PASSWORD_KDF_SCRYPT) {
+        // N must be a power of two, round down so as not to exceed the target
+        uint32_t n = 1;
+        while (n <= cost / 2) n *= 2;
+        cost = n;
+    }
+    params->cost = (uint32_t) cost;
+    return true;
+}
+
+template <typename Platform>
+const uint8_t *GateKeeperT<Platform>::GetPreparedPasswordKey(const uint8_t *key,
+        uint32_t key_length) {
+    uint32_t state = __atomic_load_n(&prepared_password_key_state_, __ATOMIC_ACQUIRE);
+    if (state == PREPARED_KEY_READY) return prepared_password_key_.get();
+    if (state != PREPARED_KEY_UNPREPARED) return NULL;
+
+    // Only attempted once: on failure the raw key is used from then on. So is
+    // it by concurrent requests while another one is preparing the key.
+    if (!__atomic_compare_exchange_n(&prepared_password_key_state_, &state,
+            PREPARED_KEY_PREPARING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return state == PREPARED_KEY_READY ? prepared_password_key_.get() : NULL;
+    }
+
+    state = PREPARED_KEY_UNSUPPORTED;
+    uint32_t length = platform()->GetPreparedPasswordKeySize();
+    if (length != 0) {
+        prepared_password_key_.reset(new uint8_t[length]);
+        prepared_password_key_length_ = length;
+        if (platform()->PreparePasswordKey(prepared_password_key_.get(), length, key,
+                key_length)) {
+            state = PREPARED_KEY_READY;
+        } else {
+            DropPreparedPasswordKey();
+        }
+    }
+
+    __atomic_store_n(&prepared_password_key_state_, state, __ATOMIC_RELEASE);
+    return state == PREPARED_KEY_READY ? prepared_password_key_.get() : NULL;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::DropPreparedPasswordKey() {
+    if (prepared_password_key_.get() == NULL) return;
+    memset_s(prepared_password_key_.get(), 0, prepared_password_key_length_);
+    prepared_password_key_.reset();
+    prepared_password_key_length_ = 0;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::DoVerify(const password_handle_t *expected_handle,
+        const SizedBuffer &password) {
+    if (!password.Data()) return false;
+
+    // The candidate handle only lives long enough to compare signatures,
+    // so keep it on the stack rather than allocating a SizedBuffer.
+    password_handle_t generated_handle;
+    if (!CreatePasswordHandle(&generated_handle, expected_handle->salt, expected_handle->user_id,
+            expected_handle->flags, expected_handle->version, &expected_handle->kdf,
+            password.Data(), password.length)) {
+        return false;
+    }
+
+    bool match = memcmp_s(generated_handle.signature, expected_handle->signature,
+            sizeof(expected_handle->signature)) == 0;
+    memset_s(&generated_handle, 0, sizeof(generated_handle));
+    return match;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::MintAuthToken(hw_auth_token_t *token, uint64_t timestamp,
+        secure_id_t user_id, secure_id_t authenticator_id, uint64_t challenge,
+        const uint8_t *auth_token_key, uint32_t key_len) {
+    if (token == NULL) return;
+
+    token->version = HW_AUTH_TOKEN_VERSION;
+    token->challenge = challenge;
+    token->user_id = user_id;
+    token->authenticator_id = authenticator_id;
+    token->authenticator_type = htonl(HW_AUTH_PASSWORD);
+    token->timestamp = htobe64(timestamp);
+
+    if (auth_token_key != NULL) {
+        uint32_t hash_len = (uint32_t)((uint8_t *)&token->hmac - (uint8_t *)token);
+        if (platform()->BeginSignature(auth_token_key, key_len)) {
+            platform()->UpdateSignature(reinterpret_cast<uint8_t *>(token), hash_len);
+            platform()->FinishSignature(token->hmac, sizeof(token->hmac));
+        } else {
+            platform()->ComputeSignature(token->hmac, sizeof(token->hmac), auth_token_key, key_len,
+                    reinterpret_cast<uint8_t *>(token), hash_len);
+        }
+    } else {
+        memset(token->hmac, 0, sizeof(token->hmac));
+    }
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::SetThrottleSchedule(const uint32_t *timeouts, uint32_t length) {
+    if (timeouts == NULL || length == 0) {
+        timeouts = DEFAULT_THROTTLE_SCHEDULE;
+        length = DEFAULT_THROTTLE_SCHEDULE_LENGTH;
+    }
+    throttle_schedule_ = timeouts;
+    throttle_schedule_length_ = length;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::EnableVerifyCache(uint32_t ttl_ms) {
+    if (ttl_ms == 0) return;
+
+    verify_cache_ttl_ms_ = ttl_ms;
+    if (verify_cache_entries_.get() != NULL) return;
+
+    verify_cache_entries_.reset(new verify_cache_entry_t[VERIFY_CACHE_ENTRIES]);
+    memset(verify_cache_entries_.get(), 0, sizeof(verify_cache_entry_t) * VERIFY_CACHE_ENTRIES);
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::PasswordHandleWellFormed(const SizedBuffer &handle) const {
+    const uint8_t *data = handle.Data();
+    if (data == NULL || handle.length < HANDLE_LENGTH_MIN) return false;
+
+    const password_handle_t *password_handle = reinterpret_cast<const password_handle_t *>(data);
+    if (password_handle->version > HANDLE_VERSION) return false;
+    // Handles from HANDLE_VERSION_KDF on must be long enough to hold their KDF parameters
+    if (password_handle->version >= HANDLE_VERSION_KDF
+            && handle.length < sizeof(*password_handle)) {
+        return false;
+    }
+    if ((password_handle->flags & ~(uint64_t) HANDLE_FLAGS_KNOWN) != 0) return false;
+
+    // Read as a byte, a foreign handle may hold anything in place of a bool
+    uint8_t hardware_backed = data[offsetof(password_handle_t, hardware_backed)];
+    return hardware_backed == (platform()->IsHardwareBacked() ? 1 : 0);
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::CheckPassword(uint32_t uid, const password_handle_t *password_handle,
+        const SizedBuffer &password, uint64_t timestamp) {
+    if (verify_cache_entries_.get() == NULL || concurrent_ || !password.Data()) {
+        return platform()->DoVerify(password_handle, password);
+    }
+
+    if (!verify_cache_keyed_) {
+        platform()->GetRandom(verify_cache_key_, sizeof(verify_cache_key_));
+        verify_cache_keyed_ = true;
+    }
+
+    // Only a keyed digest of the password is kept, never the password itself
+    uint8_t digest[sizeof(verify_cache_entries_[0].password_digest)];
+    platform()->ComputeSignature(digest, sizeof(digest), verify_cache_key_,
+            sizeof(verify_cache_key_), password.Data(), password.length);
+
+    // The entry holds the whole handle, so one differing in any field, signed or not, misses
+    uint32_t handle_length = password_handle->version >= HANDLE_VERSION_KDF
+            ? sizeof(*password_handle) : HANDLE_LENGTH_MIN;
+
+    verify_cache_entry_t *slot = NULL;
+    for (uint32_t i = 0; i < VERIFY_CACHE_ENTRIES; i++) {
+        verify_cache_entry_t *entry = &verify_cache_entries_[i];
+        if (entry->expires_at != 0 && (entry->expires_at <= timestamp
+                || timestamp + verify_cache_ttl_ms_ < entry->expires_at)) {
+            // expired, or the clock went backwards
+            memset_s(entry, 0, sizeof(*entry));
+        }
+        if (entry->expires_at == 0) {
+            if (slot == NULL) slot = entry;
+            continue;
+        }
+        if (entry->uid == uid
+                && memcmp_s(entry->handle, password_handle, handle_length) == 0
+                && memcmp_s(entry->password_digest, digest, sizeof(digest)) == 0) {
+            memset_s(digest, 0, sizeof(digest));
+            return true;
+        }
+    }
+
+    bool match = platform()->DoVerify(password_handle, password);
+    if (match) {
+        if (slot == NULL) {
+            slot = &verify_cache_entries_[verify_cache_next_];
+            verify_cache_next_ = (verify_cache_next_ + 1) % VERIFY_CACHE_ENTRIES;
+        }
+        memset_s(slot, 0, sizeof(*slot));
+        slot->uid = uid;
+        memcpy(slot->handle, password_handle, handle_length);
+        memcpy(slot->password_digest, digest, sizeof(digest));
+        slot->expires_at = timestamp + verify_cache_ttl_ms_;
+    } else {
+        DropVerifyCacheEntries(uid);
+    }
+    memset_s(digest, 0, sizeof(digest));
+    return match;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::DropVerifyCacheEntries(uint32_t uid) {
+    if (verify_cache_entries_.get() == NULL) return;
+
+    for (uint32_t i = 0; i < VERIFY_CACHE_ENTRIES; i++) {
+        verify_cache_entry_t *entry = &verify_cache_entries_[i];
+        if (entry->expires_at != 0 && entry->uid == uid) memset_s(entry, 0, sizeof(*entry));
+    }
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::DropVerifyCache() {
+    if (verify_cache_entries_.get() == NULL) return;
+
+    memset_s(verify_cache_entries_.get(), 0, sizeof(verify_cache_entry_t) * VERIFY_CACHE_ENTRIES);
+    verify_cache_entries_.reset();
+    memset_s(verify_cache_key_, 0, sizeof(verify_cache_key_));
+    verify_cache_keyed_ = false;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::EnableRandomPool(uint32_t size, uint32_t max_age_ms) {
+    DropRandomPool();
+    if (size == 0) return;
+
+    random_pool_.reset(new uint8_t[size]);
+    random_pool_size_ = size;
+    // empty, filled by the first draw
+    random_pool_offset_ = size;
+    random_pool_max_age_ms_ = max_age_ms;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::DrawRandom(void *random, uint32_t size) {
+    if (random_pool_.get() == NULL || concurrent_ || size > random_pool_size_) {
+        platform()->GetRandom(random, size);
+        return;
+    }
+
+    uint64_t now = 0;
+    if (random_pool_max_age_ms_ > 0) {
+        now = platform()->GetMillisecondsSinceBoot();
+        if (now < random_pool_filled_at_
+                || now - random_pool_filled_at_ >= random_pool_max_age_ms_) {
+            // reseed: nothing drawn before the deadline is handed out after it
+            memset_s(random_pool_.get(), 0, random_pool_size_);
+            random_pool_offset_ = random_pool_size_;
+        }
+    }
+
+    uint8_t *out = static_cast<uint8_t *>(random);
+    while (size > 0) {
+        if (random_pool_offset_ == random_pool_size_) {
+            platform()->GetRandom(random_pool_.get(), random_pool_size_);
+            random_pool_offset_ = 0;
+            random_pool_filled_at_ = now;
+        }
+
+        uint32_t available = random_pool_size_ - random_pool_offset_;
+        uint32_t chunk = size < available ? size : available;
+        uint8_t *pooled = random_pool_.get() + random_pool_offset_;
+        memcpy(out, pooled, chunk);
+        memset_s(pooled, 0, chunk);
+        random_pool_offset_ += chunk;
+        out += chunk;
+        size -= chunk;
+    }
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::DropRandomPool() {
+    if (random_pool_.get() == NULL) return;
+
+    memset_s(random_pool_.get(), 0, random_pool_size_);
+    random_pool_.reset();
+    random_pool_size_ = 0;
+    random_pool_offset_ = 0;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::EnableFastVerify() {
+    if (fast_verify_entries_.get() != NULL) return;
+
+    fast_verify_entries_.reset(new fast_verify_entry_t[FAST_VERIFY_ENTRIES]);
+    memset(fast_verify_entries_.get(), 0, sizeof(fast_verify_entry_t) * FAST_VERIFY_ENTRIES);
+}
+
+template <typename Platform>
+typename GateKeeperT<Platform>::fast_verify_state_t GateKeeperT<Platform>::GetFastVerifyState(
+        uint32_t uid, secure_id_t user_id) const {
+    if (fast_verify_entries_.get() == NULL || concurrent_) return FAST_VERIFY_NONE;
+
+    for (uint32_t i = 0; i < FAST_VERIFY_ENTRIES; i++) {
+        const fast_verify_entry_t &entry = fast_verify_entries_[i];
+        if (entry.state != FAST_VERIFY_NONE && entry.uid == uid && entry.user_id == user_id) {
+            return entry.state;
+        }
+    }
+    return FAST_VERIFY_NONE;
+}
+
+template <typename Platform>
+void GateKeeperT<Platform>::SetFastVerifyState(uint32_t uid, secure_id_t user_id,
+        fast_verify_state_t state) {
+    if (fast_verify_entries_.get() == NULL || concurrent_) return;
+
+    fast_verify_entry_t *slot = NULL;
+    fast_verify_entry_t *pending = NULL;
+    for (uint32_t i = 0; i < FAST_VERIFY_ENTRIES; i++) {
+        fast_verify_entry_t *entry = &fast_verify_entries_[i];
+        if (entry->state != FAST_VERIFY_NONE && entry->uid == uid) {
+            slot = entry;
+            break;
+        }
+        if (slot == NULL && entry->state == FAST_VERIFY_NONE) slot = entry;
+        if (pending == NULL && entry->state == FAST_VERIFY_PENDING) pending = entry;
+    }
+
+    if (slot == NULL) {
+        if (state == FAST_VERIFY_NONE) return;
+        // A CLEAN entry is the only record of a stale count in storage, forgetting
+        // it would charge that count as a failure. Without room the attempt simply
+        // isn't tracked, and a success clears the record as usual.
+        if (pending == NULL) return;
+        slot = pending;
+    }
+
+    slot->uid = uid;
+    slot->user_id = user_id;
+    slot->state = state;
+}
+
+template <typename Platform>
+uint32_t GateKeeperT<Platform>::ComputeRetryTimeout(const failure_record_t *record) {
+    uint32_t index = record->failure_counter;
+    if (index >= throttle_schedule_length_) index = throttle_schedule_length_ - 1;
+
+    uint32_t timeout = throttle_schedule_[index];
+    return timeout < THROTTLE_MAX_TIMEOUT_MS ? timeout : THROTTLE_MAX_TIMEOUT_MS;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::ThrottleRequest(uint32_t uid, uint64_t timestamp,
+        failure_record_t *record, bool secure, GateKeeperMessage *response) {
+
+    uint32_t timeout = platform()->ComputeRetryTimeout(record);
+    if (timeout == 0) return false;
+
+    // we have a pending timeout
+    uint64_t last_checked = record->last_checked_timestamp;
+    uint64_t session = BootSessionTag();
+    bool earlier_boot = session != 0 && (last_checked >> BOOT_SESSION_SHIFT) != session;
+    if (earlier_boot && !concurrent_) {
+        // checked during an earlier boot, restart the window at the first
+        // attempt of this one without writing that back: the failure that
+        // follows the window rewrites the record in this session anyway
+        uint64_t elapsed = timestamp - AnchorBootSession(uid, last_checked, timestamp);
+        if (elapsed >= timeout) return false;
+        Count(&gatekeeper_stats_t::throttled);
+        response->SetRetryTimeout(timeout - elapsed);
+        return true;
+    }
+
+    last_checked &= BOOT_TIMESTAMP_MASK;
+    if (!earlier_boot && timestamp > last_checked) {
+        // subtracting rather than adding keeps a corrupt timestamp from overflowing
+        uint64_t elapsed = timestamp - last_checked;
+        if (elapsed >= timeout) return false;
+        // attempt before timeout expired, return remaining time
+        Count(&gatekeeper_stats_t::throttled);
+        response->SetRetryTimeout(timeout - elapsed);
+        return true;
+    }
+
+    // device was rebooted or timer reset, don't count as new failure but
+    // reset timeout
+    Count(&gatekeeper_stats_t::throttled);
+    record->last_checked_timestamp = RecordTimestamp(timestamp);
+    TraceBegin(PHASE_WRITE_FAILURE_RECORD);
+    bool written = platform()->WriteFailureRecord(uid, record, secure);
+    TraceEnd(PHASE_WRITE_FAILURE_RECORD);
+    if (!written) {
+        response->error = ERROR_UNKNOWN;
+        return true;
+    }
+    response->SetRetryTimeout(timeout);
+    return true;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::IncrementFailureRecord(uint32_t uid, secure_id_t user_id,
+        uint64_t timestamp, failure_record_t *record, bool secure) {
+    record->secure_user_id = user_id;
+    record->failure_counter++;
+    record->last_checked_timestamp = RecordTimestamp(timestamp);
+
+    TraceBegin(PHASE_WRITE_FAILURE_RECORD);
+    bool written = platform()->WriteFailureRecord(uid, record, secure);
+    TraceEnd(PHASE_WRITE_FAILURE_RECORD);
+    return written;
+}
+
+template <typename Platform>
+uint64_t GateKeeperT<Platform>::BootSessionTag() const {
+    uint32_t session = platform()->GetBootSessionId();
+    // never 0, which untagged records carry
+    return session == 0 ? 0 : (session - 1) % BOOT_SESSION_TAGS + 1;
+}
+
+template <typename Platform>
+uint64_t GateKeeperT<Platform>::RecordTimestamp(uint64_t timestamp) const {
+    return (BootSessionTag() << BOOT_SESSION_SHIFT) | (timestamp & BOOT_TIMESTAMP_MASK);
+}
+
+template <typename Platform>
+uint64_t GateKeeperT<Platform>::AnchorBootSession(uint32_t uid, uint64_t last_checked,
+        uint64_t timestamp) {
+    if (boot_anchors_.get() == NULL) {
+        boot_anchors_.reset(new boot_anchor_t[BOOT_ANCHOR_ENTRIES]);
+        memset(boot_anchors_.get(), 0, sizeof(boot_anchor_t) * BOOT_ANCHOR_ENTRIES);
+    }
+
+    boot_anchor_t *slot = NULL;
+    for (uint32_t i = 0; i < BOOT_ANCHOR_ENTRIES; i++) {
+        boot_anchor_t *entry = &boot_anchors_[i];
+        if (entry->used && entry->uid == uid) {
+            slot = entry;
+            break;
+        }
+    }
+
+    if (slot != NULL && slot->last_checked == last_checked && slot->anchored_at <= timestamp) {
+        return slot->anchored_at;
+    }
+
+    // a forgotten anchor only restarts the window later, which is stricter
+    if (slot == NULL) {
+        slot = &boot_anchors_[boot_anchor_next_];
+        boot_anchor_next_ = (boot_anchor_next_ + 1) % BOOT_ANCHOR_ENTRIES;
+    }
+    slot->uid = uid;
+    slot->used = true;
+    slot->last_checked = last_checked;
+    slot->anchored_at = timestamp;
+    return timestamp;
+}
+
+template <typename Platform>
+bool GateKeeperT<Platform>::CommitFailureRecords() {
+    TraceBegin(PHASE_COMMIT_FAILURE_RECORDS);
+    bool committed = platform()->CommitFailureRecordTransaction();
+    TraceEnd(PHASE_COMMIT_FAILURE_RECORDS);
+    return committed;
+}
+
+} // namespace gatekeeper
+
+#endif // GATEKEEPER_IMPL_H_
@@ -20,6 +20,7 @@
 #include <UniquePtr.h>
 
 
+#include "arena.h"
 #include "gatekeeper_utils.h"
 /**
  * Message serialization objects for communicating with the hardware gatekeeper.
@@ -28,17 +29,59 @@ namespace gatekeeper {
 
 const uint32_t ENROLL = 0;
 const uint32_t VERIFY = 1;
+const uint32_t GET_STATS = 2;
+
+/**
+ * Framed wire format, see GateKeeperMessage::SerializeFrame.
+ *
+ * A frame is a gatekeeper_frame_header_t followed, unless error is set, by the
+ * message's fixed size scalar fields, the lengths of its buffers as uint32_t,
+ * and the contents of its buffers in order. Each of these parts, and each
+ * buffer, is padded to GATEKEEPER_FRAME_ALIGNMENT, so every field is naturally
+ * aligned in a frame that starts on an aligned address.
+ */
+const uint32_t GATEKEEPER_FRAME_VERSION = 1;
+const uint32_t GATEKEEPER_FRAME_ALIGNMENT = 8;
+// Set in the frame type of responses, whose low bits are the command
+const uint32_t GATEKEEPER_FRAME_RESPONSE = 0x80000000;
+const uint32_t GATEKEEPER_FRAME_MAX_BUFFERS = 3;
+
+struct gatekeeper_frame_header_t {
+    uint32_t version;
+    // command, ORed with GATEKEEPER_FRAME_RESPONSE for responses
+    uint32_t type;
+    // total length of the frame in bytes, including this header
+    uint32_t length;
+    uint32_t error;
+    uint32_t user_id;
+    uint32_t retry_timeout;
+};
 
 typedef enum {
     ERROR_NONE = 0,
     ERROR_INVALID = 1,
     ERROR_RETRY = 2,
     ERROR_UNKNOWN = 3,
+    // the password handle is malformed or was not created by this implementation
+    ERROR_INVALID_HANDLE = 4,
 } gatekeeper_error_t;
 
+/**
+ * Error code read off the wire or out of storage. Values this version
+ * doesn't know become ERROR_UNKNOWN rather than an out of range
+ * gatekeeper_error_t.
+ */
+inline gatekeeper_error_t wire_error(uint32_t error) {
+    return error <= ERROR_INVALID_HANDLE ? static_cast<gatekeeper_error_t>(error) : ERROR_UNKNOWN;
+}
+
 struct SizedBuffer {
     SizedBuffer() {
         length = 0;
+        capacity_ = 0;
+        capacity_owner_ = NULL;
+        view = NULL;
+        view_writable = false;
     }
 
     /*
@@ -52,6 +95,9 @@ struct SizedBuffer {
             buffer.reset();
         }
         this->length = length;
+        SetCapacity(length);
+        view = NULL;
+        view_writable = false;
     }
 
     /*
@@ -62,10 +108,157 @@ struct SizedBuffer {
     SizedBuffer(uint8_t buf[], uint32_t len) {
         buffer.reset(buf);
         length = len;
+        SetCapacity(len);
+        view = NULL;
+        view_writable = false;
+    }
+
+    /*
+     * Allocates an uninitialized buffer of len bytes. An owned buffer with
+     * at least len bytes of capacity is reused, with the bytes past len
+     * wiped. Otherwise memory comes from arena if one is given and has
+     * room, and from the heap as a last resort. Arena memory is not owned:
+     * it is wiped and reclaimed by Arena::Reset, so the SizedBuffer must
+     * not be used past that point.
+     */
+    void Allocate(uint32_t len, Arena *arena) {
+        view = NULL;
+        view_writable = false;
+        uint32_t capacity = Capacity();
+        if (buffer.get() != NULL && len <= capacity) {
+            memset_s(buffer.get() + len, 0, capacity - len);
+            length = len;
+            return;
+        }
+
+        uint8_t *memory = (arena != NULL && len != 0) ? arena->Allocate(len) : NULL;
+        if (memory == NULL) {
+            Release();
+            buffer.reset(len != 0 ? new uint8_t[len] : NULL);
+            length = len;
+            SetCapacity(len);
+            return;
+        }
+
+        SetView(memory, len);
+        view_writable = true;
+    }
+
+    /*
+     * Turns this SizedBuffer into a non-owning view of len bytes at buf,
+     * wiping and releasing any buffer it owned. The viewed memory is
+     * neither freed nor wiped on destruction, so it must outlive this
+     * object.
+     */
+    void SetView(const uint8_t *buf, uint32_t len) {
+        Release();
+        view = buf;
+        view_writable = false;
+        length = len;
+    }
+
+    /*
+     * Empties the buffer for reuse: owned contents are wiped but the
+     * memory is kept for the next Allocate, views are dropped.
+     */
+    void Clear() {
+        if (buffer.get() != NULL) {
+            // length covers buffers replaced directly, whose capacity is unknown
+            uint32_t capacity = Capacity();
+            memset_s(buffer.get(), 0, capacity > length ? capacity : length);
+        }
+        view = NULL;
+        view_writable = false;
+        length = 0;
+    }
+
+    /*
+     * Wipes and frees any owned buffer and drops any view.
+     */
+    void Release() {
+        Clear();
+        buffer.reset();
+        SetCapacity(0);
+    }
+
+    /*
+     * Moves the contents of src, owned or viewed, into this SizedBuffer,
+     * releasing what it held before. src is left empty.
+     */
+    void Take(SizedBuffer *src) {
+        Release();
+        uint32_t capacity = src->Capacity();
+        buffer.reset(src->buffer.release());
+        length = src->length;
+        SetCapacity(capacity);
+        view = src->view;
+        view_writable = src->view_writable;
+        src->length = 0;
+        src->SetCapacity(0);
+        src->view = NULL;
+        src->view_writable = false;
+    }
+
+    /*
+     * Returns the size of the memory owned by buffer, at least length, as
+     * recorded by the last Allocate. A buffer replaced directly through
+     * buffer has no known capacity beyond length and reports 0, so it is
+     * never reused or wiped past its length.
+     */
+    uint32_t Capacity() const {
+        return buffer.get() != NULL && buffer.get() == capacity_owner_ ? capacity_ : 0;
+    }
+
+    /*
+     * Returns the contents, whether owned or viewed, or NULL if empty: a
+     * cleared buffer keeps its memory but holds nothing.
+     */
+    const uint8_t *Data() const {
+        if (length == 0) return NULL;
+        return buffer.get() != NULL ? buffer.get() : view;
+    }
+
+    /*
+     * Returns the contents for writing, or NULL if empty or a read-only view.
+     */
+    uint8_t *MutableData() {
+        if (length == 0) return NULL;
+        if (buffer.get() != NULL) return buffer.get();
+        return view_writable ? const_cast<uint8_t *>(view) : NULL;
     }
 
     UniquePtr<uint8_t[]> buffer;
     uint32_t length;
+    // Set only for non-owning views, see SetView and Allocate
+    const uint8_t *view;
+    // True if view points at writable memory, i.e. came from an Arena
+    bool view_writable;
+
+private:
+    void SetCapacity(uint32_t capacity) {
+        capacity_ = capacity;
+        capacity_owner_ = buffer.get();
+    }
+
+    // capacity_ only holds while buffer still owns capacity_owner_
+    uint32_t capacity_;
+    const uint8_t *capacity_owner_;
+};
+
+/**
+ * Outcome counters aggregated by GateKeeper since it was constructed.
+ */
+struct __attribute__((__packed__)) gatekeeper_stats_t {
+    uint32_t enroll_requests;
+    uint32_t verify_requests;
+    uint32_t verify_successes;
+    // wrong passwords, including those answered with a retry timeout
+    uint32_t verify_failures;
+    // failed attempts answered with a retry timeout
+    uint32_t retry_timeouts;
+    // requests rejected inside a throttle window without checking the password
+    uint32_t throttled;
+    uint32_t reenroll_requested;
 };
 
 /*
@@ -74,8 +267,9 @@ struct SizedBuffer {
  * to protected pure virtual functions implemented by subclasses.
  */
 struct GateKeeperMessage {
-    GateKeeperMessage() : error(ERROR_NONE) {}
-    GateKeeperMessage(gatekeeper_error_t error) : error(error) {}
+    GateKeeperMessage() : error(ERROR_NONE), arena(NULL), borrow_buffers(false) {}
+    GateKeeperMessage(gatekeeper_error_t error)
+            : error(error), arena(NULL), borrow_buffers(false) {}
     virtual ~GateKeeperMessage() {}
 
     /**
@@ -92,11 +286,70 @@ struct GateKeeperMessage {
      */
     uint32_t Serialize(uint8_t *payload, const uint8_t *end) const;
 
+    /**
+     * Single pass variant of Serialize for callers that already hold an
+     * output buffer, such as an IPC message, and don't want to query
+     * GetSerializedSize first.
+     *
+     * Writes the object to payload if it fits in capacity bytes. Always
+     * returns the serialized size; a value greater than capacity means
+     * nothing was written and the caller must retry with a larger buffer.
+     */
+    uint32_t SerializeInto(uint8_t *payload, uint32_t capacity) const;
+
     /**
      * Inflates the object from its serial representation.
      */
     gatekeeper_error_t Deserialize(const uint8_t *payload, const uint8_t *end);
 
+    /**
+     * Like Deserialize, but leaves every SizedBuffer field as a view into
+     * payload instead of copying it to the heap. The caller must keep payload
+     * alive and unmodified for as long as the fields are in use.
+     */
+    gatekeeper_error_t DeserializeView(const uint8_t *payload, const uint8_t *end);
+
+    /**
+     * Returns the size in bytes of the object in the framed wire format.
+     */
+    uint32_t GetFrameSize() const;
+
+    /**
+     * Writes the object to payload in the framed wire format if it fits in
+     * capacity bytes. Like SerializeInto, always returns the frame size.
+     * payload should be aligned to GATEKEEPER_FRAME_ALIGNMENT.
+     */
+    uint32_t SerializeFrame(uint8_t *payload, uint32_t capacity) const;
+
+    /**
+     * Inflates the object from a frame of at most length bytes at payload.
+     * The whole frame is validated before any field is read: it must start on
+     * a GATEKEEPER_FRAME_ALIGNMENT aligned address, carry the current version
+     * and the type of this message, and its buffer lengths must exactly account
+     * for its length. Anything else is ERROR_INVALID.
+     */
+    gatekeeper_error_t DeserializeFrame(const uint8_t *payload, uint32_t length);
+
+    /**
+     * Like DeserializeFrame, but with the buffer semantics of DeserializeView.
+     */
+    gatekeeper_error_t DeserializeFrameView(const uint8_t *payload, uint32_t length);
+
+    /**
+     * Checks that the length bytes at payload start with a frame header of the
+     * current version whose length fits, and returns it in header, so that a
+     * dispatcher can route on header->type without parsing the message.
+     */
+    static bool PeekFrameHeader(const uint8_t *payload, uint32_t length,
+            const gatekeeper_frame_header_t **header);
+
+    /**
+     * Returns the object to its default constructed state so that it can be
+     * reused for the next request. Buffer contents are wiped, but owned
+     * memory is retained and only grows when a larger buffer arrives.
+     */
+    void Reset();
+
     /**
      * Calls may fail due to throttling. If so, this sets a timeout in milliseconds
      * for when the caller should attempt the call again. Additionally, sets the
@@ -129,9 +382,43 @@ struct GateKeeperMessage {
         return ERROR_NONE;
     }
 
+    /**
+     * Resets the subclass specific scalar fields for Reset. Buffers are
+     * cleared through frameBuffers.
+     */
+    virtual void nonErrorReset() { }
+
+    /**
+     * Framed format hooks. GetFrameType returns the frame type of the message.
+     * nonErrorFrameFixedSize returns the size of the subclass specific scalar
+     * fields, which nonErrorFrameSerialize and nonErrorFrameDeserialize write
+     * to and read from the aligned fixed size part of the frame.
+     * frameBuffers stores pointers to the subclass' buffers, at most
+     * GATEKEEPER_FRAME_MAX_BUFFERS, in frame order and returns their count.
+     */
+    virtual uint32_t GetFrameType() const = 0;
+    virtual uint32_t nonErrorFrameFixedSize() const { return 0; }
+    virtual void nonErrorFrameSerialize(uint8_t *) const { }
+    virtual void nonErrorFrameDeserialize(const uint8_t *) { }
+    virtual uint32_t frameBuffers(SizedBuffer **) { return 0; }
+
     gatekeeper_error_t error;
     uint32_t user_id;
     uint32_t retry_timeout;
+
+    /**
+     * Optional per-request arena. When set, Deserialize copies buffers into
+     * it instead of the heap, and GateKeeper allocates the buffers it places
+     * in a response from it. NULL by default.
+     */
+    Arena *arena;
+
+protected:
+    /**
+     * True while DeserializeView is running; tells nonErrorDeserialize
+     * implementations to borrow rather than copy buffers.
+     */
+    bool borrow_buffers;
 };
 
 struct VerifyRequest : public GateKeeperMessage {
@@ -146,6 +433,13 @@ struct VerifyRequest : public GateKeeperMessage {
     virtual uint32_t nonErrorSerializedSize() const;
     virtual void nonErrorSerialize(uint8_t *buffer) const;
     virtual gatekeeper_error_t nonErrorDeserialize(const uint8_t *payload, const uint8_t *end);
+    virtual void nonErrorReset() { challenge = 0; }
+
+    virtual uint32_t GetFrameType() const { return VERIFY; }
+    virtual uint32_t nonErrorFrameFixedSize() const;
+    virtual void nonErrorFrameSerialize(uint8_t *fixed) const;
+    virtual void nonErrorFrameDeserialize(const uint8_t *fixed);
+    virtual uint32_t frameBuffers(SizedBuffer **buffers);
 
     uint64_t challenge;
     SizedBuffer password_handle;
@@ -162,6 +456,13 @@ struct VerifyResponse : public GateKeeperMessage {
     virtual uint32_t nonErrorSerializedSize() const;
     virtual void nonErrorSerialize(uint8_t *buffer) const;
     virtual gatekeeper_error_t nonErrorDeserialize(const uint8_t *payload, const uint8_t *end);
+    virtual void nonErrorReset() { request_reenroll = false; }
+
+    virtual uint32_t GetFrameType() const { return VERIFY | GATEKEEPER_FRAME_RESPONSE; }
+    virtual uint32_t nonErrorFrameFixedSize() const;
+    virtual void nonErrorFrameSerialize(uint8_t *fixed) const;
+    virtual void nonErrorFrameDeserialize(const uint8_t *fixed);
+    virtual uint32_t frameBuffers(SizedBuffer **buffers);
 
     SizedBuffer auth_token;
     bool request_reenroll;
@@ -177,6 +478,9 @@ struct EnrollRequest : public GateKeeperMessage {
     virtual void nonErrorSerialize(uint8_t *buffer) const;
     virtual gatekeeper_error_t nonErrorDeserialize(const uint8_t *payload, const uint8_t *end);
 
+    virtual uint32_t GetFrameType() const { return ENROLL; }
+    virtual uint32_t frameBuffers(SizedBuffer **buffers);
+
     /**
      * The password handle returned from the previous call to enroll or NULL
      * if none
@@ -204,8 +508,35 @@ public:
     virtual void nonErrorSerialize(uint8_t *buffer) const;
     virtual gatekeeper_error_t nonErrorDeserialize(const uint8_t *payload, const uint8_t *end);
 
+    virtual uint32_t GetFrameType() const { return ENROLL | GATEKEEPER_FRAME_RESPONSE; }
+    virtual uint32_t frameBuffers(SizedBuffer **buffers);
+
    SizedBuffer enrolled_password_handle;
 };
+
+struct GetStatsRequest : public GateKeeperMessage {
+    GetStatsRequest(uint32_t user_id);
+    GetStatsRequest();
+
+    virtual uint32_t GetFrameType() const { return GET_STATS; }
+};
+
+struct GetStatsResponse : public GateKeeperMessage {
+    GetStatsResponse(uint32_t user_id, const gatekeeper_stats_t &stats);
+    GetStatsResponse();
+
+    virtual uint32_t nonErrorSerializedSize() const;
+    virtual void nonErrorSerialize(uint8_t *buffer) const;
+    virtual gatekeeper_error_t nonErrorDeserialize(const uint8_t *payload, const uint8_t *end);
+    virtual void nonErrorReset() { memset(&stats, 0, sizeof(stats)); }
+
+    virtual uint32_t GetFrameType() const { return GET_STATS | GATEKEEPER_FRAME_RESPONSE; }
+    virtual uint32_t nonErrorFrameFixedSize() const;
+    virtual void nonErrorFrameSerialize(uint8_t *fixed) const;
+    virtual void nonErrorFrameDeserialize(const uint8_t *fixed);
+
+    gatekeeper_stats_t stats;
+};
 }
 
 #endif // GATEKEEPER_MESSAGES_H_
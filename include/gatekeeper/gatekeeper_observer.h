@@ -0,0 +1,57 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_OBSERVER_H_
+#define GATEKEEPER_OBSERVER_H_
+
+#include <stdint.h>
+
+namespace gatekeeper {
+
+/**
+ * Phases of Enroll and Verify reported to a GateKeeperObserver. The
+ * failure record and signing phases nest inside ENROLL and VERIFY.
+ */
+typedef enum {
+    PHASE_ENROLL = 0,
+    PHASE_VERIFY = 1,
+    PHASE_GET_FAILURE_RECORD = 2,
+    PHASE_WRITE_FAILURE_RECORD = 3,
+    PHASE_CLEAR_FAILURE_RECORD = 4,
+    PHASE_COMMIT_FAILURE_RECORDS = 5,
+    PHASE_PASSWORD_SIGNATURE = 6,
+    PHASE_MINT_AUTH_TOKEN = 7,
+    PHASE_PASSWORD_KDF = 8,
+} gatekeeper_phase_t;
+
+/**
+ * Receives latency traces from a GateKeeper, see GateKeeper::SetObserver.
+ *
+ * Callbacks run synchronously on the request path, so they should do no
+ * more than record the event. Timestamps are in nanoseconds from
+ * GateKeeper::GetTraceTimestamp.
+ */
+class GateKeeperObserver {
+public:
+    virtual ~GateKeeperObserver() {}
+
+    virtual void OnPhaseBegin(gatekeeper_phase_t phase, uint64_t timestamp_ns) = 0;
+    virtual void OnPhaseEnd(gatekeeper_phase_t phase, uint64_t timestamp_ns) = 0;
+};
+
+}
+
+#endif // GATEKEEPER_OBSERVER_H_
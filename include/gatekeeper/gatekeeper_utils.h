@@ -17,25 +17,25 @@
 #ifndef GOOGLE_GATEKEEPER_UTILS_H_
 #define GOOGLE_GATEKEEPER_UTILS_H_
 
+#include <stdint.h>
 #include <string.h>
 
 namespace gatekeeper {
 /**
- * Variant of memset() that uses GCC-specific pragmas to disable optimizations, so effect is not
- * optimized away.  This is important because we often need to wipe blocks of sensitive data from
- * memory.  As an additional convenience, this implementation avoids writing to NULL pointers.
+ * Variant of memset() whose effect is not optimized away, even on memory that is
+ * about to be freed or go out of scope.  This is important because we often need
+ * to wipe blocks of sensitive data from memory.  The barrier after the memset
+ * tells the compiler that the memory is read, so the store can't be elided,
+ * while the memset itself still gets the optimized library implementation.  As
+ * an additional convenience, this implementation avoids writing to NULL pointers.
  */
-#ifdef __clang__
-#define OPTNONE __attribute__((optnone))
-#else  // not __clang__
-#define OPTNONE __attribute__((optimize("O0")))
-#endif  // not __clang__
-inline OPTNONE void* memset_s(void* s, int c, size_t n) {
+inline void* memset_s(void* s, int c, size_t n) {
     if (!s)
         return s;
-    return memset(s, c, n);
+    memset(s, c, n);
+    __asm__ __volatile__("" : : "r"(s) : "memory");
+    return s;
 }
-#undef OPTNONE
 
 /**
  * Return the number of elements in array \p a.
@@ -44,10 +44,26 @@ template <typename T, size_t N> inline size_t array_length(const T (&)[N]) {
     return N;
 }
 
+/**
+ * Constant time comparison: the time taken depends only on length, never on the
+ * contents of the buffers or on where they differ.  Compares a word at a time,
+ * which the compiler is free to vectorize, and folds every difference into one
+ * accumulator that is tested once at the end.
+ *
+ * Returns 0 if the buffers are equal, 1 otherwise.
+ */
 static inline int memcmp_s(const void* p1, const void* p2, size_t length) {
     const uint8_t* s1 = static_cast<const uint8_t*>(p1);
     const uint8_t* s2 = static_cast<const uint8_t*>(p2);
-    uint8_t result = 0;
+    uint64_t result = 0;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        uint64_t w1, w2;
+        memcpy(&w1, s1, sizeof(w1));
+        memcpy(&w2, s2, sizeof(w2));
+        result |= w1 ^ w2;
+        s1 += sizeof(uint64_t);
+        s2 += sizeof(uint64_t);
+    }
     while (length-- > 0)
         result |= *s1++ ^ *s2++;
     return result == 0 ? 0 : 1;
@@ -17,19 +17,48 @@
 #ifndef GATEKEEPER_PASSWORD_HANDLE_H_
 #define GATEKEEPER_PASSWORD_HANDLE_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define HANDLE_FLAG_THROTTLE_SECURE 1
+// Every flag this version understands, handles with any other bit set are rejected
+#define HANDLE_FLAGS_KNOWN (HANDLE_FLAG_THROTTLE_SECURE)
 
 #define HANDLE_VERSION_THROTTLE 2
+#define HANDLE_VERSION_KDF 3
+
+// Password KDF algorithms, see password_kdf_params_t
+#define PASSWORD_KDF_PBKDF2_HMAC_SHA256 1
+#define PASSWORD_KDF_SCRYPT 2
+
+// Length in bytes of the KDF output that is signed in place of the password
+#define PASSWORD_KDF_OUTPUT_LENGTH 32
 
 namespace gatekeeper {
 
 typedef uint64_t secure_id_t;
 typedef uint64_t salt_t;
+
+/**
+ * Parameters of the password KDF stage recorded in handles of version
+ * HANDLE_VERSION_KDF and later.
+ *
+ * cost is the linear work factor: the iteration count for PBKDF2, or N for
+ * scrypt, which must then be a power of two. block_size and parallelism are
+ * scrypt's r and p, and are zero for PBKDF2.
+ */
+struct __attribute__ ((__packed__)) password_kdf_params_t {
+    uint8_t algorithm;
+    uint32_t cost;
+    uint32_t block_size;
+    uint32_t parallelism;
+};
+
 /**
  * structure for easy serialization
  * and deserialization of password handles.
  */
-static const uint8_t HANDLE_VERSION = 2;
+static const uint8_t HANDLE_VERSION = HANDLE_VERSION_KDF;
 struct __attribute__ ((__packed__)) password_handle_t {
     // fields included in signature
     uint8_t version;
@@ -41,7 +70,13 @@ struct __attribute__ ((__packed__)) password_handle_t {
     uint8_t signature[32];
 
     bool hardware_backed;
+
+    // included in signature, only present from HANDLE_VERSION_KDF on
+    password_kdf_params_t kdf;
 };
+
+// Length of handles before HANDLE_VERSION_KDF, the shortest accepted
+static const uint32_t HANDLE_LENGTH_MIN = offsetof(password_handle_t, kdf);
 }
 
 #endif // GATEKEEPER_PASSWORD_HANDLE_H_
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_THROTTLE_SCHEDULE_H_
+#define GATEKEEPER_THROTTLE_SCHEDULE_H_
+
+#include <stdint.h>
+
+namespace gatekeeper {
+
+/**
+ * Upper bound on any throttle timeout, in milliseconds.
+ */
+static const uint32_t THROTTLE_MAX_TIMEOUT_MS = 1000 * 60 * 60 * 24;
+
+/*
+ * Calculates the default timeout in milliseconds as a function of the failure
+ * counter 'x' as follows:
+ *
+ * [0. 5) -> 0
+ * 5 -> 30
+ * [6, 10) -> 0
+ * [11, 30) -> 30
+ * [30, 140) -> 30 * (2^((x - 30)/10))
+ * [140, inf) -> 1 day
+ *
+ */
+constexpr uint32_t default_retry_timeout(uint32_t failure_counter) {
+    return failure_counter == 0 ? 0
+            : failure_counter <= 10 ? (failure_counter % 5 == 0 ? 30000 : 0)
+            : failure_counter < 30 ? 30000
+            : failure_counter < 140 ? 30000u << ((failure_counter - 30) / 10)
+            : THROTTLE_MAX_TIMEOUT_MS;
+}
+
+/**
+ * A throttle schedule is a table of timeouts in milliseconds indexed by
+ * failure counter. Counters past the end of the table use its last entry,
+ * and every entry is clamped to THROTTLE_MAX_TIMEOUT_MS.
+ *
+ * The default schedule is default_retry_timeout evaluated at compile time
+ * for every counter up to the point where it reaches one day.
+ */
+static const uint32_t DEFAULT_THROTTLE_SCHEDULE_LENGTH = 141;
+extern const uint32_t DEFAULT_THROTTLE_SCHEDULE[DEFAULT_THROTTLE_SCHEDULE_LENGTH];
+
+}
+
+#endif // GATEKEEPER_THROTTLE_SCHEDULE_H_
@@ -3,6 +3,8 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS := \
+	$(LOCAL_DIR)/failure_record_cache.cpp \
+	$(LOCAL_DIR)/gatekeeper_compact_messages.cpp \
 	$(LOCAL_DIR)/gatekeeper_messages.cpp \
 	$(LOCAL_DIR)/gatekeeper.cpp
 
@@ -24,6 +24,49 @@ LOCAL_SHARED_LIBRARIES := libgatekeeper libcrypto libhardware
 LOCAL_STATIC_LIBRARIES := libscrypt_static
 LOCAL_C_INCLUDES := external/scrypt/lib/crypto
 LOCAL_SRC_FILES := \
+	failure_record_cache_test.cpp \
 	gatekeeper_messages_test.cpp \
+	gatekeeper_test.cpp \
+	gatekeeper_utils_test.cpp \
 	gatekeeper_device_test.cpp
 include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := gatekeeper-benchmarks
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+LOCAL_CFLAGS += -g -Wall -Werror -std=gnu++11 -Wno-missing-field-initializers
+LOCAL_SHARED_LIBRARIES := libgatekeeper libcrypto
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := \
+	gatekeeper_benchmark.cpp
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := gatekeeper-messages-replay
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+LOCAL_CFLAGS += -g -Wall -Werror -std=gnu++11 -Wno-missing-field-initializers
+LOCAL_SHARED_LIBRARIES := libgatekeeper
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := \
+	gatekeeper_messages_replay.cpp
+include $(BUILD_EXECUTABLE)
+
+# One libFuzzer target per message type, e.g. gatekeeper_verify_request_fuzzer
+define gatekeeper-message-fuzzer
+include $$(CLEAR_VARS)
+LOCAL_MODULE := gatekeeper_$(1)_fuzzer
+LOCAL_ADDITIONAL_DEPENDENCIES := $$(LOCAL_PATH)/Android.mk
+LOCAL_CFLAGS += -g -Wall -Werror -std=gnu++11 -Wno-missing-field-initializers \
+	-DGATEKEEPER_FUZZ_MESSAGE=$(2)
+LOCAL_SHARED_LIBRARIES := libgatekeeper
+LOCAL_SRC_FILES := \
+	gatekeeper_messages_fuzzer.cpp
+include $$(BUILD_FUZZ_TEST)
+endef
+
+$(eval $(call gatekeeper-message-fuzzer,verify_request,VerifyRequest))
+$(eval $(call gatekeeper-message-fuzzer,verify_response,VerifyResponse))
+$(eval $(call gatekeeper-message-fuzzer,enroll_request,EnrollRequest))
+$(eval $(call gatekeeper-message-fuzzer,enroll_response,EnrollResponse))
+$(eval $(call gatekeeper-message-fuzzer,get_stats_request,GetStatsRequest))
+$(eval $(call gatekeeper-message-fuzzer,get_stats_response,GetStatsResponse))
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+
+#include <gatekeeper/failure_record_cache.h>
+
+using ::gatekeeper::FailureRecordCache;
+using ::gatekeeper::FailureRecordJournal;
+using ::gatekeeper::failure_record_journal_entry_t;
+using ::gatekeeper::failure_record_t;
+
+class MemoryJournal : public FailureRecordJournal {
+public:
+    MemoryJournal() : appends(0), rewrites(0) {}
+
+    virtual bool Append(const failure_record_journal_entry_t *entry) {
+        appends++;
+        entries.push_back(*entry);
+        return true;
+    }
+
+    virtual bool Read(uint32_t index, failure_record_journal_entry_t *entry) {
+        if (index >= entries.size()) return false;
+        *entry = entries[index];
+        return true;
+    }
+
+    virtual bool Rewrite(const failure_record_journal_entry_t *new_entries, uint32_t count) {
+        rewrites++;
+        entries.assign(new_entries, new_entries + count);
+        return true;
+    }
+
+    std::vector<failure_record_journal_entry_t> entries;
+    int appends;
+    int rewrites;
+};
+
+static const uint32_t UID = 10;
+static const uint64_t SID = 0x1234;
+
+static void fail_once(FailureRecordCache *cache, uint64_t timestamp) {
+    failure_record_t record;
+    ASSERT_TRUE(cache->Get(UID, SID, &record));
+    record.failure_counter++;
+    record.last_checked_timestamp = timestamp;
+    ASSERT_TRUE(cache->Write(UID, &record));
+}
+
+TEST(FailureRecordCacheTest, IncrementsAreDurable) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 4);
+    ASSERT_TRUE(cache.Load());
+
+    fail_once(&cache, 100);
+    fail_once(&cache, 200);
+    ASSERT_EQ(2, journal.appends);
+
+    // a fresh cache replaying the journal sees both failures
+    FailureRecordCache rebooted(&journal, 4);
+    ASSERT_TRUE(rebooted.Load());
+    failure_record_t record;
+    ASSERT_TRUE(rebooted.Get(UID, SID, &record));
+    ASSERT_EQ((uint32_t) 2, record.failure_counter);
+    ASSERT_EQ((uint64_t) 200, record.last_checked_timestamp);
+}
+
+TEST(FailureRecordCacheTest, ClearIsWrittenBack) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 4);
+    ASSERT_TRUE(cache.Load());
+
+    fail_once(&cache, 100);
+    ASSERT_TRUE(cache.Clear(UID, SID));
+    ASSERT_EQ(1, journal.appends);
+
+    failure_record_t record;
+    ASSERT_TRUE(cache.Get(UID, SID, &record));
+    ASSERT_EQ((uint32_t) 0, record.failure_counter);
+
+    // persisted count still covers the next failure, so nothing is written
+    fail_once(&cache, 300);
+    ASSERT_EQ(1, journal.appends);
+
+    // going past it persists the cleared state along with the new count
+    fail_once(&cache, 400);
+    ASSERT_EQ(2, journal.appends);
+    FailureRecordCache rebooted(&journal, 4);
+    ASSERT_TRUE(rebooted.Load());
+    ASSERT_TRUE(rebooted.Get(UID, SID, &record));
+    ASSERT_EQ((uint32_t) 2, record.failure_counter);
+    ASSERT_EQ((uint64_t) 400, record.last_checked_timestamp);
+
+    // and Flush persists pending clears
+    ASSERT_TRUE(cache.Clear(UID, SID));
+    ASSERT_TRUE(cache.Flush());
+    ASSERT_EQ(3, journal.appends);
+}
+
+TEST(FailureRecordCacheTest, NewUserIdIsDurable) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 4);
+    ASSERT_TRUE(cache.Load());
+
+    for (int i = 0; i < 3; i++) fail_once(&cache, 100 + i);
+
+    // re-enrollment: the first failure for the new user must not be lost,
+    // even though its counter is lower than the persisted one
+    ASSERT_TRUE(cache.Clear(UID, SID + 1));
+    failure_record_t record;
+    ASSERT_TRUE(cache.Get(UID, SID + 1, &record));
+    record.failure_counter = 1;
+    int appends = journal.appends;
+    ASSERT_TRUE(cache.Write(UID, &record));
+    ASSERT_EQ(appends + 1, journal.appends);
+}
+
+TEST(FailureRecordCacheTest, TornTailIsDropped) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 4);
+    ASSERT_TRUE(cache.Load());
+    fail_once(&cache, 100);
+    fail_once(&cache, 200);
+
+    journal.entries.back().checksum ^= 1;
+
+    FailureRecordCache rebooted(&journal, 4);
+    ASSERT_TRUE(rebooted.Load());
+    ASSERT_EQ(1, journal.rewrites);
+    ASSERT_EQ((size_t) 1, journal.entries.size());
+    failure_record_t record;
+    ASSERT_TRUE(rebooted.Get(UID, SID, &record));
+    ASSERT_EQ((uint32_t) 1, record.failure_counter);
+}
+
+TEST(FailureRecordCacheTest, Compaction) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 2);
+    ASSERT_TRUE(cache.Load());
+
+    for (int i = 0; i < 20; i++) fail_once(&cache, 100 + i);
+    ASSERT_LE(journal.entries.size(), (size_t) 8);
+    ASSERT_GT(journal.rewrites, 0);
+
+    FailureRecordCache rebooted(&journal, 2);
+    ASSERT_TRUE(rebooted.Load());
+    failure_record_t record;
+    ASSERT_TRUE(rebooted.Get(UID, SID, &record));
+    ASSERT_EQ((uint32_t) 20, record.failure_counter);
+}
+
+static void fail(FailureRecordCache *cache, uint32_t uid, uint64_t timestamp) {
+    failure_record_t record;
+    ASSERT_TRUE(cache->Get(uid, SID, &record));
+    record.failure_counter++;
+    record.last_checked_timestamp = timestamp;
+    ASSERT_TRUE(cache->Write(uid, &record));
+}
+
+TEST(FailureRecordCacheTest, Full) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 1);
+    ASSERT_TRUE(cache.Load());
+    fail(&cache, 1, 100);
+
+    // only uids with failures on record hold on to their slot
+    failure_record_t record;
+    ASSERT_TRUE(cache.Get(2, SID, &record));
+    record.failure_counter = 1;
+    ASSERT_FALSE(cache.Write(2, &record));
+    ASSERT_TRUE(cache.Clear(2, SID));
+}
+
+TEST(FailureRecordCacheTest, ClearedSlotsAreReused) {
+    MemoryJournal journal;
+    FailureRecordCache cache(&journal, 2);
+    ASSERT_TRUE(cache.Load());
+
+    // UID keeps its failure throughout, while many more uids come and go in the other slot
+    fail_once(&cache, 100);
+    for (uint32_t uid = 100; uid < 110; uid++) {
+        fail(&cache, uid, 200 + uid);
+        ASSERT_TRUE(cache.Clear(uid, SID));
+    }
+
+    FailureRecordCache rebooted(&journal, 2);
+    ASSERT_TRUE(rebooted.Load());
+    failure_record_t record;
+    ASSERT_TRUE(rebooted.Get(UID, SID, &record));
+    ASSERT_EQ((uint32_t) 1, record.failure_counter);
+    ASSERT_EQ((uint64_t) 100, record.last_checked_timestamp);
+    for (uint32_t uid = 100; uid < 110; uid++) {
+        ASSERT_TRUE(rebooted.Get(uid, SID, &record));
+        // the last uid's clear is still pending, so it comes back as it was persisted
+        ASSERT_EQ((uint32_t) (uid == 109 ? 1 : 0), record.failure_counter) << uid;
+    }
+
+    // and a Flush persists it, freeing the slot
+    ASSERT_TRUE(cache.Flush());
+    fail(&cache, 200, 400);
+    ASSERT_TRUE(cache.Clear(200, SID));
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_FAKE_GATEKEEPER_H_
+#define GATEKEEPER_FAKE_GATEKEEPER_H_
+
+#include <map>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include <gatekeeper/gatekeeper.h>
+
+namespace gatekeeper {
+
+/**
+ * In-process GateKeeper for unit tests. Signatures are SHA-256 over
+ * key || salt || message, which is enough to tell passwords apart without
+ * pulling in a real HMAC. Time and failure records live in memory, and
+ * counters record how often each platform hook is hit.
+ */
+class FakeGateKeeper : public GateKeeper {
+public:
+    FakeGateKeeper() : now(1000), streaming(false), prepared_key(false), kdf(false),
+            kdf_cost_per_ms(0), transactions(false), fail_commit(false), async_commit(false),
+            storage_latency_us(0), boot_session(0),
+            random_seed(1), password_key_fetches(0), password_key_preparations(0),
+            kdf_derivations(0), auth_token_key_fetches(0), random_draws(0), record_reads(0), record_writes(0),
+            record_clears(0), commits(0), started_commits(0) {
+        memset(password_key, 'p', sizeof(password_key));
+        memset(auth_token_key, 'a', sizeof(auth_token_key));
+        memset(&kdf_params, 0, sizeof(kdf_params));
+        kdf_params.algorithm = PASSWORD_KDF_PBKDF2_HMAC_SHA256;
+        kdf_params.cost = 16;
+    }
+
+    using GateKeeper::ComputeRetryTimeout;
+    using GateKeeper::SetThrottleSchedule;
+    using GateKeeper::EnableFastVerify;
+    using GateKeeper::EnableAuthTokenKeyCache;
+    using GateKeeper::EnableVerifyCache;
+    using GateKeeper::EnableRandomPool;
+
+    void Advance(uint64_t ms) { now += ms; }
+
+    failure_record_t *Record(uint32_t uid, bool secure) {
+        return &(secure ? secure_records : insecure_records)[uid];
+    }
+
+    uint64_t now;
+    // when true, signatures go through the Begin/Update/Finish hooks
+    bool streaming;
+    // when true, password signatures start from a prepared SHA-256 state
+    bool prepared_key;
+    // when true, new handles are enrolled with kdf_params, only PBKDF2 is supported
+    bool kdf;
+    password_kdf_params_t kdf_params;
+    // if non-zero, each derivation advances the clock by cost / kdf_cost_per_ms
+    uint32_t kdf_cost_per_ms;
+    // when true, failure record transactions are supported and counted
+    bool transactions;
+    bool fail_commit;
+    // when true, commits are started by StartFailureRecordCommit and left pending
+    bool async_commit;
+    // simulated latency of every failure record access
+    uint32_t storage_latency_us;
+    // returned by GetBootSessionId
+    uint32_t boot_session;
+    mutable uint64_t random_seed;
+    uint8_t password_key[32];
+    uint8_t auth_token_key[32];
+
+    int password_key_fetches;
+    int password_key_preparations;
+    int kdf_derivations;
+    mutable int auth_token_key_fetches;
+    mutable int random_draws;
+    int record_reads;
+    int record_writes;
+    int record_clears;
+    int commits;
+    int started_commits;
+
+protected:
+    virtual bool GetAuthTokenKey(const uint8_t **key, uint32_t *length) const {
+        // GateKeeper takes ownership of the returned key
+        uint8_t *copy = new uint8_t[sizeof(auth_token_key)];
+        memcpy(copy, auth_token_key, sizeof(auth_token_key));
+        *key = copy;
+        *length = sizeof(auth_token_key);
+        auth_token_key_fetches++;
+        return true;
+    }
+
+    virtual void GetPasswordKey(const uint8_t **key, uint32_t *length) {
+        *key = password_key;
+        *length = sizeof(password_key);
+        password_key_fetches++;
+    }
+
+    virtual void ComputePasswordSignature(uint8_t *signature, uint32_t signature_length,
+            const uint8_t *key, uint32_t key_length, const uint8_t *password,
+            uint32_t password_length, salt_t salt) const {
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, key, key_length);
+        SHA256_Update(&ctx, &salt, sizeof(salt));
+        SHA256_Update(&ctx, password, password_length);
+        Finish(&ctx, signature, signature_length);
+    }
+
+    virtual bool BeginPasswordSignature(const uint8_t *key, uint32_t key_length, salt_t salt) {
+        if (!streaming) return false;
+        SHA256_Init(&stream_ctx);
+        SHA256_Update(&stream_ctx, key, key_length);
+        SHA256_Update(&stream_ctx, &salt, sizeof(salt));
+        return true;
+    }
+
+    virtual uint32_t GetPreparedPasswordKeySize() const {
+        return prepared_key ? sizeof(SHA256_CTX) : 0;
+    }
+
+    virtual bool PreparePasswordKey(uint8_t *prepared, uint32_t prepared_length,
+            const uint8_t *key, uint32_t key_length) {
+        if (prepared_length != sizeof(SHA256_CTX)) return false;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, key, key_length);
+        memcpy(prepared, &ctx, sizeof(ctx));
+        password_key_preparations++;
+        return true;
+    }
+
+    virtual void BeginPreparedPasswordSignature(const uint8_t *prepared,
+            uint32_t /* prepared_length */, salt_t salt) {
+        memcpy(&stream_ctx, prepared, sizeof(stream_ctx));
+        SHA256_Update(&stream_ctx, &salt, sizeof(salt));
+    }
+
+    virtual void UpdatePasswordSignature(const uint8_t *message, uint32_t length) {
+        SHA256_Update(&stream_ctx, message, length);
+    }
+
+    virtual void FinishPasswordSignature(uint8_t *signature, uint32_t signature_length) {
+        Finish(&stream_ctx, signature, signature_length);
+    }
+
+    virtual bool GetPasswordKdfParams(password_kdf_params_t *params) const {
+        if (!kdf) return false;
+        *params = kdf_params;
+        return true;
+    }
+
+    virtual bool DerivePassword(uint8_t *derived, uint32_t derived_length,
+            const password_kdf_params_t *params, const uint8_t *password,
+            uint32_t password_length, salt_t salt) {
+        if (params->algorithm != PASSWORD_KDF_PBKDF2_HMAC_SHA256 || params->cost == 0) {
+            return false;
+        }
+        if (!PKCS5_PBKDF2_HMAC(reinterpret_cast<const char *>(password), password_length,
+                reinterpret_cast<const uint8_t *>(&salt), sizeof(salt), params->cost,
+                EVP_sha256(), derived_length, derived)) {
+            return false;
+        }
+        if (kdf_cost_per_ms > 0) now += params->cost / kdf_cost_per_ms;
+        kdf_derivations++;
+        return true;
+    }
+
+    virtual void GetRandom(void *random, uint32_t requested_size) const {
+        uint8_t *out = static_cast<uint8_t *>(random);
+        random_draws++;
+        for (uint32_t i = 0; i < requested_size; i++) {
+            random_seed = random_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            out[i] = random_seed >> 56;
+        }
+    }
+
+    virtual void ComputeSignature(uint8_t *signature, uint32_t signature_length,
+            const uint8_t *key, uint32_t key_length, const uint8_t *message,
+            const uint32_t length) const {
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, key, key_length);
+        SHA256_Update(&ctx, message, length);
+        Finish(&ctx, signature, signature_length);
+    }
+
+    virtual uint64_t GetMillisecondsSinceBoot() const { return now; }
+
+    virtual uint32_t GetBootSessionId() const { return boot_session; }
+
+    virtual bool GetFailureRecord(uint32_t uid, secure_id_t user_id, failure_record_t *record,
+            bool secure) {
+        record_reads++;
+        StorageDelay();
+        failure_record_t *stored = Record(uid, secure);
+        if (stored->secure_user_id != user_id) {
+            memset(stored, 0, sizeof(*stored));
+            stored->secure_user_id = user_id;
+        }
+        *record = *stored;
+        return true;
+    }
+
+    virtual bool ClearFailureRecord(uint32_t uid, secure_id_t user_id, bool secure) {
+        record_clears++;
+        StorageDelay();
+        failure_record_t *stored = Record(uid, secure);
+        memset(stored, 0, sizeof(*stored));
+        stored->secure_user_id = user_id;
+        return true;
+    }
+
+    virtual bool WriteFailureRecord(uint32_t uid, failure_record_t *record, bool secure) {
+        record_writes++;
+        StorageDelay();
+        *Record(uid, secure) = *record;
+        return true;
+    }
+
+    virtual bool BeginFailureRecordTransaction() { return transactions; }
+
+    virtual bool CommitFailureRecordTransaction() {
+        commits++;
+        return !fail_commit;
+    }
+
+    virtual bool StartFailureRecordCommit() {
+        if (!async_commit) return false;
+        started_commits++;
+        return true;
+    }
+
+    virtual bool IsHardwareBacked() const { return false; }
+
+private:
+    void StorageDelay() const {
+        if (storage_latency_us > 0) usleep(storage_latency_us);
+    }
+
+    static void Finish(SHA256_CTX *ctx, uint8_t *signature, uint32_t signature_length) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        SHA256_Final(digest, ctx);
+        memset(signature, 0, signature_length);
+        memcpy(signature, digest,
+                signature_length < sizeof(digest) ? signature_length : sizeof(digest));
+    }
+
+    SHA256_CTX stream_ctx;
+    std::map<uint32_t, failure_record_t> secure_records;
+    std::map<uint32_t, failure_record_t> insecure_records;
+};
+
+}
+
+#endif // GATEKEEPER_FAKE_GATEKEEPER_H_
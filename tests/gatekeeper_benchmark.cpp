@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Micro-benchmarks for the libgatekeeper hot paths.
+ *
+ * Usage: gatekeeper-benchmarks [iterations] [storage_latency_us] [kdf_target_ms]
+ *
+ * For every benchmark prints the mean time and the number of heap
+ * allocations per operation. Enroll and Verify run against FakeGateKeeper,
+ * with storage_latency_us added to every failure record access.
+ *
+ * If kdf_target_ms is given, also calibrates the PBKDF2 cost for that unlock
+ * latency on this machine and times Verify with the resulting handles.
+ *
+ * Also compares how long memcmp_s takes on equal buffers and on buffers
+ * differing in their first byte, which should be about the same.
+ *
+ * Ends with the memory a session keeping one request and its response takes,
+ * as deserialized messages and in compact form.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gatekeeper/gatekeeper_compact_messages.h>
+#include <gatekeeper/gatekeeper_utils.h>
+
+#include "fake_gatekeeper.h"
+
+using ::gatekeeper::EnrollRequest;
+using ::gatekeeper::EnrollResponse;
+using ::gatekeeper::FakeGateKeeper;
+using ::gatekeeper::GateKeeperMessage;
+using ::gatekeeper::SizedBuffer;
+using ::gatekeeper::VerifyRequest;
+using ::gatekeeper::VerifyResponse;
+using ::gatekeeper::failure_record_t;
+using ::gatekeeper::memcmp_s;
+using ::gatekeeper::password_kdf_params_t;
+
+static uint64_t allocations = 0;
+static uint64_t allocated_bytes = 0;
+
+// GCC 11 and later see the malloc behind operator new and flag the matching
+// free as mismatched once these are inlined into a new/delete pair
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) abort();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+template <typename Operation>
+static void run(const char *name, uint32_t param, uint32_t iterations, Operation operation) {
+    uint64_t start_allocations = allocations;
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < iterations; i++) {
+        operation();
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint64_t allocated = allocations - start_allocations;
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s/%u", name, param);
+    printf("%-36s %12.1f ns/op %8.2f allocs/op\n", label, (double) elapsed / iterations,
+            (double) allocated / iterations);
+}
+
+static SizedBuffer *make_buffer(uint32_t size) {
+    SizedBuffer *result = new SizedBuffer(size);
+    for (uint32_t i = 0; i < size; i++) {
+        result->buffer[i] = i;
+    }
+    return result;
+}
+
+template <typename Message>
+static void benchmark_codec(const char *name, const Message &msg, uint32_t param,
+        uint32_t iterations) {
+    uint32_t size = msg.GetSerializedSize();
+    UniquePtr<uint8_t[]> serialized(new uint8_t[size]);
+    const uint8_t *end = serialized.get() + size;
+    char label[48];
+
+    snprintf(label, sizeof(label), "%s::Serialize", name);
+    run(label, param, iterations, [&] {
+        SizedBuffer out(msg.GetSerializedSize());
+        msg.Serialize(out.buffer.get(), out.buffer.get() + out.length);
+    });
+
+    snprintf(label, sizeof(label), "%s::SerializeInto", name);
+    run(label, param, iterations, [&] { msg.SerializeInto(serialized.get(), size); });
+
+    snprintf(label, sizeof(label), "%s::Deserialize", name);
+    run(label, param, iterations, [&] {
+        Message parsed;
+        parsed.Deserialize(serialized.get(), end);
+    });
+
+    snprintf(label, sizeof(label), "%s::DeserializeView", name);
+    run(label, param, iterations, [&] {
+        Message parsed;
+        parsed.DeserializeView(serialized.get(), end);
+    });
+
+    uint32_t frame_size = msg.GetFrameSize();
+    UniquePtr<uint64_t[]> frame(new uint64_t[frame_size / sizeof(uint64_t)]);
+    uint8_t *frame_bytes = reinterpret_cast<uint8_t *>(frame.get());
+
+    snprintf(label, sizeof(label), "%s::SerializeFrame", name);
+    run(label, param, iterations, [&] { msg.SerializeFrame(frame_bytes, frame_size); });
+
+    snprintf(label, sizeof(label), "%s::DeserializeFrameView", name);
+    run(label, param, iterations, [&] {
+        Message parsed;
+        parsed.DeserializeFrameView(frame_bytes, frame_size);
+    });
+}
+
+static void benchmark_messages(uint32_t iterations) {
+    static const uint32_t lengths[] = { 4, 16, 64, 256, 1024 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        uint32_t length = lengths[i];
+        UniquePtr<SizedBuffer> password(make_buffer(length));
+        UniquePtr<SizedBuffer> enrolled(make_buffer(length));
+        UniquePtr<SizedBuffer> handle(make_buffer(sizeof(::gatekeeper::password_handle_t)));
+        EnrollRequest enroll_request(0, handle.get(), password.get(), enrolled.get());
+        benchmark_codec("EnrollRequest", enroll_request, length, iterations);
+
+        password.reset(make_buffer(length));
+        handle.reset(make_buffer(sizeof(::gatekeeper::password_handle_t)));
+        VerifyRequest verify_request(0, 1, handle.get(), password.get());
+        benchmark_codec("VerifyRequest", verify_request, length, iterations);
+    }
+
+    UniquePtr<SizedBuffer> handle(make_buffer(sizeof(::gatekeeper::password_handle_t)));
+    EnrollResponse enroll_response(0, handle.get());
+    benchmark_codec("EnrollResponse", enroll_response, handle->length, iterations);
+
+    UniquePtr<SizedBuffer> token(make_buffer(sizeof(hw_auth_token_t)));
+    VerifyResponse verify_response(0, token.get());
+    benchmark_codec("VerifyResponse", verify_response, token->length, iterations);
+}
+
+/*
+ * Bytes requested from the heap for a Message deserialized from wire,
+ * including the object itself but not allocator overhead.
+ */
+template <typename Message>
+static uint64_t held_bytes(const GateKeeperMessage &wire) {
+    uint32_t size = wire.GetSerializedSize();
+    UniquePtr<uint8_t[]> serialized(new uint8_t[size]);
+    wire.SerializeInto(serialized.get(), size);
+
+    uint64_t start = allocated_bytes;
+    UniquePtr<Message> message(new Message);
+    message->Deserialize(serialized.get(), serialized.get() + size);
+    return allocated_bytes - start;
+}
+
+static void report_footprint() {
+    static const uint32_t password_length = 16;
+    UniquePtr<SizedBuffer> password(make_buffer(password_length));
+    UniquePtr<SizedBuffer> enrolled(make_buffer(password_length));
+    UniquePtr<SizedBuffer> handle(make_buffer(sizeof(::gatekeeper::password_handle_t)));
+    EnrollRequest enroll_request(0, handle.get(), password.get(), enrolled.get());
+    handle.reset(make_buffer(sizeof(::gatekeeper::password_handle_t)));
+    EnrollResponse enroll_response(0, handle.get());
+    uint64_t enroll = held_bytes<EnrollRequest>(enroll_request)
+            + held_bytes<EnrollResponse>(enroll_response);
+
+    password.reset(make_buffer(password_length));
+    handle.reset(make_buffer(sizeof(::gatekeeper::password_handle_t)));
+    VerifyRequest verify_request(0, 1, handle.get(), password.get());
+    UniquePtr<SizedBuffer> token(make_buffer(sizeof(hw_auth_token_t)));
+    VerifyResponse verify_response(0, token.get());
+    uint64_t verify = held_bytes<VerifyRequest>(verify_request)
+            + held_bytes<VerifyResponse>(verify_response);
+
+    printf("%-36s %12llu bytes/session %8u compact\n", "session/enroll",
+            (unsigned long long) enroll, ::gatekeeper::COMPACT_ENROLL_SESSION_SIZE);
+    printf("%-36s %12llu bytes/session %8u compact\n", "session/verify",
+            (unsigned long long) verify, ::gatekeeper::COMPACT_VERIFY_SESSION_SIZE);
+}
+
+static void benchmark_gatekeeper(uint32_t iterations, uint32_t storage_latency_us) {
+    static const uint32_t lengths[] = { 4, 16, 64, 256 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        uint32_t length = lengths[i];
+        FakeGateKeeper gatekeeper;
+        gatekeeper.storage_latency_us = storage_latency_us;
+
+        UniquePtr<SizedBuffer> password(make_buffer(length));
+        EnrollResponse enrolled;
+        run("GateKeeper::Enroll", length, iterations, [&] {
+            SizedBuffer provided(length);
+            memcpy(provided.buffer.get(), password->buffer.get(), length);
+            EnrollRequest request(0, NULL, &provided, NULL);
+            EnrollResponse response;
+            gatekeeper.Enroll(request, &response);
+        });
+        {
+            SizedBuffer provided(length);
+            memcpy(provided.buffer.get(), password->buffer.get(), length);
+            EnrollRequest request(0, NULL, &provided, NULL);
+            gatekeeper.Enroll(request, &enrolled);
+        }
+
+        // Requests are views onto one serialized message, as a TA would see them
+        UniquePtr<SizedBuffer> handle_copy(new SizedBuffer);
+        handle_copy->SetView(enrolled.enrolled_password_handle.Data(),
+                enrolled.enrolled_password_handle.length);
+        UniquePtr<SizedBuffer> password_copy(make_buffer(length));
+        VerifyRequest source(0, 0, handle_copy.get(), password_copy.get());
+        SizedBuffer serialized(source.GetSerializedSize());
+        source.Serialize(serialized.buffer.get(), serialized.buffer.get() + serialized.length);
+
+        run("GateKeeper::Verify", length, iterations, [&] {
+            VerifyRequest request;
+            request.DeserializeView(serialized.buffer.get(),
+                    serialized.buffer.get() + serialized.length);
+            VerifyResponse response;
+            gatekeeper.Verify(request, &response);
+        });
+
+        // Long lived messages as a TA would keep them: copies reuse their buffers
+        VerifyRequest reused_request;
+        VerifyResponse reused_response;
+        run("GateKeeper::Verify(reused)", length, iterations, [&] {
+            reused_request.Reset();
+            reused_request.Deserialize(serialized.buffer.get(),
+                    serialized.buffer.get() + serialized.length);
+            reused_response.Reset();
+            gatekeeper.Verify(reused_request, &reused_response);
+        });
+
+        uint8_t out[256];
+        run("GateKeeper::HandleMessage(VERIFY)", length, iterations, [&] {
+            gatekeeper.HandleMessage(::gatekeeper::VERIFY, serialized.buffer.get(),
+                    serialized.length, out, sizeof(out));
+        });
+    }
+}
+
+static void benchmark_retry_timeout(uint32_t iterations) {
+    FakeGateKeeper gatekeeper;
+    failure_record_t record;
+    memset(&record, 0, sizeof(record));
+    volatile uint32_t sink = 0;
+    run("GateKeeper::ComputeRetryTimeout", 200, iterations, [&] {
+        for (uint32_t counter = 0; counter < 200; counter++) {
+            record.failure_counter = counter;
+            sink = sink + gatekeeper.ComputeRetryTimeout(&record);
+        }
+    });
+}
+
+static void benchmark_memcmp_s(uint32_t iterations) {
+    // Large enough that an early exit would be orders of magnitude faster.
+    // The fastest of many interleaved runs filters out scheduling noise.
+    const size_t length = 64 * 1024;
+    UniquePtr<uint8_t[]> a(new uint8_t[length]);
+    UniquePtr<uint8_t[]> equal(new uint8_t[length]);
+    UniquePtr<uint8_t[]> first(new uint8_t[length]);
+    for (size_t i = 0; i < length; i++) a[i] = i;
+    memcpy(equal.get(), a.get(), length);
+    memcpy(first.get(), a.get(), length);
+    first[0] ^= 1;
+
+    uint32_t rounds = iterations / 50 + 1;
+    uint64_t best_equal = UINT64_MAX, best_first = UINT64_MAX;
+    volatile int sink = 0;
+    for (uint32_t i = 0; i < rounds; i++) {
+        uint64_t start = now_ns();
+        sink = sink + memcmp_s(a.get(), equal.get(), length);
+        uint64_t middle = now_ns();
+        sink = sink + memcmp_s(a.get(), first.get(), length);
+        uint64_t end = now_ns();
+        if (middle - start < best_equal) best_equal = middle - start;
+        if (end - middle < best_first) best_first = end - middle;
+    }
+
+    printf("%-36s %12llu ns equal %12llu ns first byte differs (%.2fx)\n", "memcmp_s/65536",
+            (unsigned long long) best_equal, (unsigned long long) best_first,
+            (double) best_first / best_equal);
+}
+
+// FakeGateKeeper on the wall clock, so that calibration sees real KDF latency
+class ClockedGateKeeper : public FakeGateKeeper {
+protected:
+    virtual uint64_t GetMillisecondsSinceBoot() const { return now_ns() / 1000000; }
+};
+
+static void benchmark_kdf(uint32_t iterations, uint32_t target_ms) {
+    ClockedGateKeeper gatekeeper;
+    gatekeeper.kdf = true;
+    memset(&gatekeeper.kdf_params, 0, sizeof(gatekeeper.kdf_params));
+    gatekeeper.kdf_params.algorithm = PASSWORD_KDF_PBKDF2_HMAC_SHA256;
+    if (!gatekeeper.CalibratePasswordKdf(target_ms, &gatekeeper.kdf_params)) {
+        printf("PBKDF2 calibration for %u ms failed\n", target_ms);
+        return;
+    }
+    printf("PBKDF2 cost for %u ms: %u\n", target_ms, gatekeeper.kdf_params.cost);
+
+    UniquePtr<SizedBuffer> password(make_buffer(16));
+    EnrollRequest enroll_request(0, NULL, password.get(), NULL);
+    EnrollResponse enrolled;
+    gatekeeper.Enroll(enroll_request, &enrolled);
+
+    auto verify = [&] {
+        SizedBuffer handle;
+        handle.SetView(enrolled.enrolled_password_handle.Data(),
+                enrolled.enrolled_password_handle.length);
+        UniquePtr<SizedBuffer> provided(make_buffer(16));
+        VerifyRequest request(0, 0, &handle, provided.get());
+        VerifyResponse response;
+        gatekeeper.Verify(request, &response);
+    };
+    run("GateKeeper::Verify/kdf", target_ms, iterations, verify);
+
+    // re-verification within the TTL, as in a confirm-credential flow
+    gatekeeper.EnableVerifyCache(60000);
+    verify();
+    run("GateKeeper::Verify/kdf,cached", target_ms, iterations, verify);
+}
+
+int main(int argc, char **argv) {
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+    uint32_t storage_latency_us = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+    uint32_t kdf_target_ms = argc > 3 ? strtoul(argv[3], NULL, 0) : 0;
+    if (iterations == 0) iterations = 1;
+
+    benchmark_messages(iterations);
+    benchmark_retry_timeout(iterations);
+    benchmark_memcmp_s(iterations);
+    benchmark_gatekeeper(storage_latency_us > 0 ? iterations / 100 + 1 : iterations,
+            storage_latency_us);
+    if (kdf_target_ms > 0) benchmark_kdf(iterations / 1000 + 1, kdf_target_ms);
+    report_footprint();
+    return 0;
+}
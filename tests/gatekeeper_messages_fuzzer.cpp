@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libFuzzer target for the message codec. Built once per message type, which
+ * GATEKEEPER_FUZZ_MESSAGE names, see tests/Android.mk.
+ */
+
+#include "gatekeeper_messages_fuzzer.h"
+
+#ifndef GATEKEEPER_FUZZ_MESSAGE
+#error "GATEKEEPER_FUZZ_MESSAGE must name the message type to fuzz"
+#endif
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    ::gatekeeper::FuzzMessage< ::gatekeeper::GATEKEEPER_FUZZ_MESSAGE>(data, size);
+    return 0;
+}
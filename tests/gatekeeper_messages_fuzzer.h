@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATEKEEPER_MESSAGES_FUZZER_H_
+#define GATEKEEPER_MESSAGES_FUZZER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <UniquePtr.h>
+
+#include <gatekeeper/gatekeeper_messages.h>
+
+namespace gatekeeper {
+
+// Inputs longer than this are only fed to the legacy format parsers
+const size_t FUZZ_MAX_FRAME_SIZE = 4096;
+
+// Aborts, which the fuzzer reports as a crash, if condition doesn't hold
+#define FUZZ_CHECK(condition) do { if (!(condition)) abort(); } while (0)
+
+/**
+ * Whatever parsed must serialize to the size it reports, and parse back
+ * with the same outcome into a message that serializes to the same bytes.
+ */
+template <typename Message>
+void FuzzCheckRoundTrip(const Message &message) {
+    uint32_t size = message.GetSerializedSize();
+    UniquePtr<uint8_t[]> serialized(new uint8_t[size]);
+    FUZZ_CHECK(message.SerializeInto(serialized.get(), size) == size);
+
+    Message parsed;
+    FUZZ_CHECK(parsed.Deserialize(serialized.get(), serialized.get() + size) == message.error);
+    FUZZ_CHECK(parsed.GetSerializedSize() == size);
+    UniquePtr<uint8_t[]> reserialized(new uint8_t[size]);
+    FUZZ_CHECK(parsed.SerializeInto(reserialized.get(), size) == size);
+    FUZZ_CHECK(memcmp(serialized.get(), reserialized.get(), size) == 0);
+}
+
+template <typename Message>
+void FuzzCheckFrameRoundTrip(const Message &message) {
+    uint32_t size = message.GetFrameSize();
+    UniquePtr<uint64_t[]> frame(new uint64_t[size / sizeof(uint64_t) + 1]);
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(frame.get());
+    FUZZ_CHECK(message.SerializeFrame(bytes, size) == size);
+
+    Message parsed;
+    FUZZ_CHECK(parsed.DeserializeFrame(bytes, size) == message.error);
+    FUZZ_CHECK(parsed.GetFrameSize() == size);
+}
+
+/**
+ * Feeds data to every parser of Message: Deserialize and DeserializeView,
+ * then DeserializeFrame and DeserializeFrameView on an aligned copy. None
+ * may read outside of data, which the sanitizers the fuzzer is built with
+ * catch, and each message parsed is checked to round trip.
+ */
+template <typename Message>
+void FuzzMessage(const uint8_t *data, size_t size) {
+    const uint8_t *end = data + size;
+    {
+        Message message;
+        if (message.Deserialize(data, end) == ERROR_NONE) FuzzCheckRoundTrip(message);
+    }
+    {
+        Message message;
+        if (message.DeserializeView(data, end) == ERROR_NONE) FuzzCheckRoundTrip(message);
+    }
+
+    if (size > FUZZ_MAX_FRAME_SIZE) return;
+    uint64_t frame[FUZZ_MAX_FRAME_SIZE / sizeof(uint64_t)];
+    if (size > 0) memcpy(frame, data, size);
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(frame);
+    {
+        Message message;
+        if (message.DeserializeFrame(bytes, size) == ERROR_NONE) {
+            FuzzCheckFrameRoundTrip(message);
+        }
+    }
+    {
+        Message message;
+        if (message.DeserializeFrameView(bytes, size) == ERROR_NONE) {
+            FuzzCheckFrameRoundTrip(message);
+        }
+    }
+}
+
+}
+
+#endif // GATEKEEPER_MESSAGES_FUZZER_H_
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput mode of the message fuzzers.
+ *
+ * Usage: gatekeeper-messages-replay [iterations] [corpus files...]
+ *
+ * Runs every input through FuzzMessage for every message type, aborting on
+ * the first broken invariant, then replays the corpus iterations times
+ * through each parser and prints messages per second and heap allocations
+ * per message. Without corpus files a built-in corpus of well-formed
+ * messages of every type, in both formats, is replayed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "gatekeeper_messages_fuzzer.h"
+
+using ::gatekeeper::EnrollRequest;
+using ::gatekeeper::EnrollResponse;
+using ::gatekeeper::FUZZ_MAX_FRAME_SIZE;
+using ::gatekeeper::FuzzMessage;
+using ::gatekeeper::GateKeeperMessage;
+using ::gatekeeper::GetStatsRequest;
+using ::gatekeeper::GetStatsResponse;
+using ::gatekeeper::SizedBuffer;
+using ::gatekeeper::VerifyRequest;
+using ::gatekeeper::VerifyResponse;
+
+static uint64_t allocations = 0;
+
+// GCC 11 and later see the malloc behind operator new and flag the matching
+// free as mismatched once these are inlined into a new/delete pair
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) abort();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct input_t {
+    std::vector<uint8_t> bytes;
+    // aligned copy for the framed parsers, empty if too long for them
+    std::vector<uint64_t> frame;
+};
+
+static void add_input(std::vector<input_t> *corpus, const uint8_t *data, size_t size) {
+    input_t input;
+    input.bytes.assign(data, data + size);
+    if (size <= FUZZ_MAX_FRAME_SIZE) {
+        input.frame.resize(size / sizeof(uint64_t) + 1);
+        memcpy(&input.frame[0], data, size);
+    }
+    corpus->push_back(input);
+}
+
+static bool load_file(std::vector<input_t> *corpus, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.insert(data.end(), chunk, chunk + read);
+    }
+    fclose(file);
+    add_input(corpus, data.empty() ? NULL : &data[0], data.size());
+    return true;
+}
+
+static SizedBuffer *make_buffer(uint32_t size) {
+    SizedBuffer *result = new SizedBuffer(size);
+    for (uint32_t i = 0; i < size; i++) {
+        result->buffer[i] = i;
+    }
+    return result;
+}
+
+static void add_message(std::vector<input_t> *corpus, const GateKeeperMessage &message) {
+    uint32_t size = message.GetSerializedSize();
+    std::vector<uint8_t> serialized(size);
+    message.SerializeInto(&serialized[0], size);
+    add_input(corpus, &serialized[0], size);
+
+    size = message.GetFrameSize();
+    std::vector<uint64_t> frame(size / sizeof(uint64_t));
+    message.SerializeFrame(reinterpret_cast<uint8_t *>(&frame[0]), size);
+    add_input(corpus, reinterpret_cast<const uint8_t *>(&frame[0]), size);
+}
+
+static void add_builtin_corpus(std::vector<input_t> *corpus) {
+    static const uint32_t PASSWORD_LENGTH = 16;
+    static const uint32_t HANDLE_LENGTH = 58;
+    static const uint32_t TOKEN_LENGTH = 69;
+
+    UniquePtr<SizedBuffer> handle(make_buffer(HANDLE_LENGTH));
+    UniquePtr<SizedBuffer> password(make_buffer(PASSWORD_LENGTH));
+    VerifyRequest verify_request(0, 1, handle.get(), password.get());
+    add_message(corpus, verify_request);
+
+    UniquePtr<SizedBuffer> token(make_buffer(TOKEN_LENGTH));
+    VerifyResponse verify_response(0, token.get());
+    add_message(corpus, verify_response);
+
+    handle.reset(make_buffer(HANDLE_LENGTH));
+    password.reset(make_buffer(PASSWORD_LENGTH));
+    UniquePtr<SizedBuffer> enrolled(make_buffer(PASSWORD_LENGTH));
+    EnrollRequest enroll_request(0, handle.get(), password.get(), enrolled.get());
+    add_message(corpus, enroll_request);
+
+    handle.reset(make_buffer(HANDLE_LENGTH));
+    EnrollResponse enroll_response(0, handle.get());
+    add_message(corpus, enroll_response);
+
+    GetStatsRequest stats_request(0);
+    add_message(corpus, stats_request);
+    GetStatsResponse stats_response;
+    add_message(corpus, stats_response);
+    VerifyResponse retry;
+    retry.SetRetryTimeout(30000);
+    add_message(corpus, retry);
+}
+
+template <typename Parse>
+static void replay(const char *name, const char *parser, const std::vector<input_t> &corpus,
+        uint32_t iterations, Parse parse) {
+    uint64_t messages = 0;
+    uint64_t start_allocations = allocations;
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < corpus.size(); j++) {
+            if (parse(corpus[j])) messages++;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint64_t allocated = allocations - start_allocations;
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s::%s", name, parser);
+    printf("%-36s %12.0f msgs/s %8.2f allocs/msg\n", label,
+            elapsed > 0 ? messages * 1e9 / elapsed : 0.0,
+            messages > 0 ? (double) allocated / messages : 0.0);
+}
+
+template <typename Message>
+static void replay_message(const char *name, const std::vector<input_t> &corpus,
+        uint32_t iterations) {
+    for (size_t i = 0; i < corpus.size(); i++) {
+        const std::vector<uint8_t> &bytes = corpus[i].bytes;
+        FuzzMessage<Message>(bytes.empty() ? NULL : &bytes[0], bytes.size());
+    }
+
+    // Every input counts as a message, whether or not it parses
+    replay(name, "Deserialize", corpus, iterations, [](const input_t &input) {
+        const uint8_t *bytes = input.bytes.empty() ? NULL : &input.bytes[0];
+        Message message;
+        message.Deserialize(bytes, bytes + input.bytes.size());
+        return true;
+    });
+    replay(name, "DeserializeView", corpus, iterations, [](const input_t &input) {
+        const uint8_t *bytes = input.bytes.empty() ? NULL : &input.bytes[0];
+        Message message;
+        message.DeserializeView(bytes, bytes + input.bytes.size());
+        return true;
+    });
+    replay(name, "DeserializeFrameView", corpus, iterations, [](const input_t &input) {
+        if (input.frame.empty()) return false;
+        Message message;
+        message.DeserializeFrameView(reinterpret_cast<const uint8_t *>(&input.frame[0]),
+                input.bytes.size());
+        return true;
+    });
+}
+
+int main(int argc, char **argv) {
+    uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+    if (iterations == 0) iterations = 1;
+
+    std::vector<input_t> corpus;
+    for (int i = 2; i < argc; i++) {
+        if (!load_file(&corpus, argv[i])) {
+            fprintf(stderr, "cannot read %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (corpus.empty()) add_builtin_corpus(&corpus);
+    printf("%zu inputs\n", corpus.size());
+
+    replay_message<VerifyRequest>("VerifyRequest", corpus, iterations);
+    replay_message<VerifyResponse>("VerifyResponse", corpus, iterations);
+    replay_message<EnrollRequest>("EnrollRequest", corpus, iterations);
+    replay_message<EnrollResponse>("EnrollResponse", corpus, iterations);
+    replay_message<GetStatsRequest>("GetStatsRequest", corpus, iterations);
+    replay_message<GetStatsResponse>("GetStatsResponse", corpus, iterations);
+    return 0;
+}
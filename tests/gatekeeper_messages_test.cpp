@@ -19,14 +19,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <gatekeeper/gatekeeper_compact_messages.h>
 #include <gatekeeper/gatekeeper_messages.h>
 
+#include "gatekeeper_messages_fuzzer.h"
+
+using ::gatekeeper::Arena;
 using ::gatekeeper::SizedBuffer;
 using ::testing::Test;
 using ::gatekeeper::EnrollRequest;
 using ::gatekeeper::EnrollResponse;
 using ::gatekeeper::VerifyRequest;
 using ::gatekeeper::VerifyResponse;
+using ::gatekeeper::GetStatsRequest;
+using ::gatekeeper::GetStatsResponse;
 using std::cout;
 using std::endl;
 
@@ -214,6 +220,156 @@ TEST(RoundTripTest, VerifyResponse) {
                 password_size));
 }
 
+TEST(RoundTripTest, VerifyRequestView) {
+    const uint32_t password_size = 512;
+    SizedBuffer *provided_password = make_buffer(password_size),
+          *password_handle = make_buffer(password_size);
+    // create request, serialize, deserialize as a view, and validate
+    VerifyRequest msg(USER_ID, 1, password_handle, provided_password);
+    SizedBuffer serialized_msg(msg.GetSerializedSize());
+    const uint8_t *begin = serialized_msg.buffer.get();
+    const uint8_t *end = begin + serialized_msg.length;
+    msg.Serialize(serialized_msg.buffer.get(), end);
+
+    VerifyRequest deserialized_msg;
+    deserialized_msg.DeserializeView(begin, end);
+
+    ASSERT_EQ(gatekeeper::gatekeeper_error_t::ERROR_NONE,
+            deserialized_msg.error);
+
+    ASSERT_EQ(USER_ID, deserialized_msg.user_id);
+    ASSERT_EQ((uint64_t) 1, deserialized_msg.challenge);
+    ASSERT_EQ(NULL, deserialized_msg.password_handle.buffer.get());
+    ASSERT_EQ(NULL, deserialized_msg.provided_password.buffer.get());
+    ASSERT_TRUE(deserialized_msg.password_handle.Data() > begin);
+    ASSERT_TRUE(deserialized_msg.provided_password.Data() + password_size == end);
+    ASSERT_EQ((uint32_t) password_size, deserialized_msg.provided_password.length);
+    ASSERT_EQ(0, memcmp(msg.provided_password.Data(), deserialized_msg.provided_password.Data(),
+                password_size));
+    ASSERT_EQ((uint32_t) password_size, deserialized_msg.password_handle.length);
+    ASSERT_EQ(0, memcmp(msg.password_handle.Data(), deserialized_msg.password_handle.Data(),
+                password_size));
+
+    // a regular Deserialize afterwards goes back to owned copies
+    deserialized_msg.Deserialize(begin, end);
+    ASSERT_EQ(NULL, deserialized_msg.provided_password.view);
+    ASSERT_EQ(0, memcmp(msg.provided_password.Data(),
+                deserialized_msg.provided_password.buffer.get(), password_size));
+    delete provided_password;
+    delete password_handle;
+}
+
+TEST(RoundTripTest, VerifyResponseSerializeInto) {
+    const uint32_t token_size = 69;
+    SizedBuffer *auth_token = make_buffer(token_size);
+    VerifyResponse msg(USER_ID, auth_token);
+    uint32_t expected_size = msg.GetSerializedSize();
+
+    // too small: nothing written, required size reported
+    uint8_t small[16];
+    memset(small, 0xAA, sizeof(small));
+    ASSERT_EQ(expected_size, msg.SerializeInto(small, sizeof(small)));
+    for (size_t i = 0; i < sizeof(small); i++) {
+        ASSERT_EQ(0xAA, small[i]);
+    }
+
+    // large enough: written in one call, identical to Serialize
+    uint8_t large[256];
+    ASSERT_EQ(expected_size, msg.SerializeInto(large, sizeof(large)));
+    SizedBuffer serialized_msg(expected_size);
+    ASSERT_EQ(expected_size, msg.Serialize(serialized_msg.buffer.get(),
+                serialized_msg.buffer.get() + serialized_msg.length));
+    ASSERT_EQ(0, memcmp(large, serialized_msg.buffer.get(), expected_size));
+
+    // an end more than 4GB past the start must not wrap to a small capacity
+    if (sizeof(uintptr_t) > sizeof(uint32_t)) {
+        const uint8_t *far_end = reinterpret_cast<const uint8_t *>(
+                reinterpret_cast<uintptr_t>(large) + ((uint64_t) 1 << 32) + 8);
+        memset(large, 0, sizeof(large));
+        ASSERT_EQ(expected_size, msg.Serialize(large, far_end));
+        ASSERT_EQ(0, memcmp(large, serialized_msg.buffer.get(), expected_size));
+    }
+
+    VerifyResponse deserialized_msg;
+    deserialized_msg.Deserialize(large, large + expected_size);
+    ASSERT_EQ(gatekeeper::gatekeeper_error_t::ERROR_NONE, deserialized_msg.error);
+    ASSERT_EQ((uint32_t) token_size, deserialized_msg.auth_token.length);
+    ASSERT_EQ(0, memcmp(msg.auth_token.buffer.get(), deserialized_msg.auth_token.buffer.get(),
+                token_size));
+    delete auth_token;
+}
+
+TEST(RoundTripTest, GetStatsResponse) {
+    ::gatekeeper::gatekeeper_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.verify_requests = 7;
+    stats.throttled = 2;
+    stats.reenroll_requested = 1;
+    GetStatsResponse msg(USER_ID, stats);
+    SizedBuffer serialized_msg(msg.GetSerializedSize());
+    msg.Serialize(serialized_msg.buffer.get(), serialized_msg.buffer.get() + serialized_msg.length);
+
+    GetStatsResponse deserialized_msg;
+    deserialized_msg.Deserialize(serialized_msg.buffer.get(), serialized_msg.buffer.get()
+            + serialized_msg.length);
+
+    ASSERT_EQ(gatekeeper::gatekeeper_error_t::ERROR_NONE,
+            deserialized_msg.error);
+    ASSERT_EQ(USER_ID, deserialized_msg.user_id);
+    ASSERT_EQ(0, memcmp(&stats, &deserialized_msg.stats, sizeof(stats)));
+
+    // truncated payload
+    GetStatsResponse truncated_msg;
+    truncated_msg.Deserialize(serialized_msg.buffer.get(), serialized_msg.buffer.get()
+            + serialized_msg.length - 1);
+    ASSERT_EQ(gatekeeper::gatekeeper_error_t::ERROR_INVALID,
+            truncated_msg.error);
+}
+
+TEST(RoundTripTest, EnrollRequestArena) {
+    const uint32_t password_size = 64;
+    SizedBuffer *provided_password = make_buffer(password_size);
+    SizedBuffer *enrolled_password = make_buffer(password_size);
+    EnrollRequest msg(USER_ID, NULL, provided_password, enrolled_password);
+    SizedBuffer serialized_msg(msg.GetSerializedSize());
+    msg.Serialize(serialized_msg.buffer.get(), serialized_msg.buffer.get() + serialized_msg.length);
+
+    uint8_t memory[256];
+    Arena arena(memory, sizeof(memory));
+    {
+        EnrollRequest deserialized_msg;
+        deserialized_msg.arena = &arena;
+        deserialized_msg.Deserialize(serialized_msg.buffer.get(), serialized_msg.buffer.get()
+                + serialized_msg.length);
+        ASSERT_EQ(gatekeeper::gatekeeper_error_t::ERROR_NONE, deserialized_msg.error);
+
+        const SizedBuffer &password = deserialized_msg.provided_password;
+        ASSERT_EQ(NULL, password.buffer.get());
+        ASSERT_TRUE(password.Data() >= memory && password.Data() < memory + sizeof(memory));
+        ASSERT_EQ(0, memcmp(msg.provided_password.buffer.get(), password.Data(), password_size));
+        ASSERT_EQ((uint32_t) 2 * password_size, arena.used());
+    }
+
+    // exhausted arenas fall back to the heap
+    uint8_t small_memory[8];
+    Arena small_arena(small_memory, sizeof(small_memory));
+    EnrollRequest heap_msg;
+    heap_msg.arena = &small_arena;
+    heap_msg.Deserialize(serialized_msg.buffer.get(), serialized_msg.buffer.get()
+            + serialized_msg.length);
+    ASSERT_EQ(gatekeeper::gatekeeper_error_t::ERROR_NONE, heap_msg.error);
+    ASSERT_TRUE(heap_msg.provided_password.buffer.get() != NULL);
+
+    // Reset wipes everything handed out
+    arena.Reset();
+    ASSERT_EQ((uint32_t) 0, arena.used());
+    for (uint32_t i = 0; i < 2 * password_size; i++) {
+        ASSERT_EQ(0, memory[i]);
+    }
+    delete provided_password;
+    delete enrolled_password;
+}
+
 TEST(RoundTripTest, VerifyResponseError) {
     VerifyResponse msg;
     msg.error = gatekeeper::gatekeeper_error_t::ERROR_INVALID;
@@ -258,6 +414,309 @@ TEST(RoundTripTest, EnrollRequestError) {
             deserialized_msg.error);
 }
 
+static SizedBuffer *serialize_verify_request(uint32_t password_size, uint64_t challenge) {
+    UniquePtr<SizedBuffer> handle(make_buffer(32)), password(make_buffer(password_size));
+    VerifyRequest msg(USER_ID, challenge, handle.get(), password.get());
+    SizedBuffer *serialized = new SizedBuffer(msg.GetSerializedSize());
+    msg.Serialize(serialized->buffer.get(), serialized->buffer.get() + serialized->length);
+    return serialized;
+}
+
+TEST(ReuseTest, VerifyRequestReset) {
+    UniquePtr<SizedBuffer> large(serialize_verify_request(64, 1));
+    UniquePtr<SizedBuffer> small(serialize_verify_request(16, 2));
+    UniquePtr<SizedBuffer> larger(serialize_verify_request(128, 3));
+
+    VerifyRequest msg;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, msg.Deserialize(large->buffer.get(),
+            large->buffer.get() + large->length));
+    const uint8_t *password = msg.provided_password.buffer.get();
+    ASSERT_EQ((uint32_t) 64, msg.provided_password.Capacity());
+
+    msg.Reset();
+    ASSERT_EQ((uint64_t) 0, msg.challenge);
+    ASSERT_EQ((uint32_t) 0, msg.user_id);
+    ASSERT_EQ((uint32_t) 0, msg.provided_password.length);
+    ASSERT_EQ(password, msg.provided_password.buffer.get());
+    for (uint32_t i = 0; i < 64; i++) {
+        ASSERT_EQ(0, password[i]);
+    }
+
+    // a smaller password reuses the buffer
+    ASSERT_EQ(gatekeeper::ERROR_NONE, msg.Deserialize(small->buffer.get(),
+            small->buffer.get() + small->length));
+    ASSERT_EQ((uint64_t) 2, msg.challenge);
+    ASSERT_EQ((uint32_t) 16, msg.provided_password.length);
+    ASSERT_EQ(password, msg.provided_password.buffer.get());
+    UniquePtr<SizedBuffer> expected(make_buffer(16));
+    ASSERT_EQ(0, memcmp(expected->buffer.get(), msg.provided_password.Data(), 16));
+
+    // a larger one grows it
+    msg.Reset();
+    ASSERT_EQ(gatekeeper::ERROR_NONE, msg.Deserialize(larger->buffer.get(),
+            larger->buffer.get() + larger->length));
+    ASSERT_EQ((uint32_t) 128, msg.provided_password.length);
+    ASSERT_EQ((uint32_t) 128, msg.provided_password.Capacity());
+}
+
+TEST(ReuseTest, ViewAfterCopy) {
+    UniquePtr<SizedBuffer> serialized(serialize_verify_request(64, 1));
+
+    VerifyRequest msg;
+    msg.Deserialize(serialized->buffer.get(), serialized->buffer.get() + serialized->length);
+    msg.Reset();
+    ASSERT_EQ(gatekeeper::ERROR_NONE, msg.DeserializeView(serialized->buffer.get(),
+            serialized->buffer.get() + serialized->length));
+    ASSERT_EQ(NULL, msg.provided_password.buffer.get());
+    ASSERT_EQ((uint32_t) 0, msg.provided_password.Capacity());
+    ASSERT_GE(msg.provided_password.Data(), serialized->buffer.get());
+    ASSERT_LT(msg.provided_password.Data(), serialized->buffer.get() + serialized->length);
+}
+
+TEST(ReuseTest, ReplacedBuffer) {
+    UniquePtr<SizedBuffer> serialized(serialize_verify_request(64, 1));
+
+    VerifyRequest msg;
+    msg.Deserialize(serialized->buffer.get(), serialized->buffer.get() + serialized->length);
+    ASSERT_EQ((uint32_t) 64, msg.provided_password.Capacity());
+
+    // the capacity recorded for the old buffer doesn't carry over to a replacement
+    msg.provided_password.buffer.reset(new uint8_t[4]);
+    msg.provided_password.length = 4;
+    ASSERT_EQ((uint32_t) 0, msg.provided_password.Capacity());
+    msg.provided_password.Allocate(16, NULL);
+    ASSERT_EQ((uint32_t) 16, msg.provided_password.Capacity());
+
+    msg.provided_password.buffer.reset(new uint8_t[4]);
+    msg.provided_password.length = 4;
+    msg.Reset();
+    ASSERT_EQ((uint32_t) 0, msg.provided_password.length);
+}
+
+TEST(FrameTest, VerifyRequest) {
+    const uint32_t password_size = 13;
+    UniquePtr<SizedBuffer> provided_password(make_buffer(password_size));
+    UniquePtr<SizedBuffer> password_handle(make_buffer(password_size + 3));
+    const uint64_t challenge = 0x1122334455667788ULL;
+    VerifyRequest msg(USER_ID, challenge, password_handle.get(), provided_password.get());
+
+    uint64_t frame[64];
+    uint32_t size = msg.SerializeFrame(reinterpret_cast<uint8_t *>(frame), sizeof(frame));
+    ASSERT_EQ(msg.GetFrameSize(), size);
+    ASSERT_EQ((uint32_t) 0, size % gatekeeper::GATEKEEPER_FRAME_ALIGNMENT);
+
+    const gatekeeper::gatekeeper_frame_header_t *header;
+    ASSERT_TRUE(gatekeeper::GateKeeperMessage::PeekFrameHeader(
+            reinterpret_cast<uint8_t *>(frame), size, &header));
+    ASSERT_EQ(gatekeeper::VERIFY, header->type);
+    ASSERT_EQ(size, header->length);
+
+    VerifyRequest copied;
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            copied.DeserializeFrame(reinterpret_cast<uint8_t *>(frame), sizeof(frame)));
+    ASSERT_EQ(USER_ID, copied.user_id);
+    ASSERT_EQ(challenge, copied.challenge);
+    ASSERT_EQ(password_size, copied.provided_password.length);
+    ASSERT_EQ(0, memcmp(msg.provided_password.Data(), copied.provided_password.Data(),
+            password_size));
+    ASSERT_EQ(password_size + 3, copied.password_handle.length);
+    ASSERT_EQ(0, memcmp(msg.password_handle.Data(), copied.password_handle.Data(),
+            password_size + 3));
+
+    VerifyRequest viewed;
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            viewed.DeserializeFrameView(reinterpret_cast<uint8_t *>(frame), size));
+    ASSERT_EQ(NULL, viewed.provided_password.buffer.get());
+    ASSERT_TRUE(viewed.provided_password.Data() > reinterpret_cast<uint8_t *>(frame));
+    ASSERT_EQ((uintptr_t) 0, reinterpret_cast<uintptr_t>(viewed.provided_password.Data())
+            % gatekeeper::GATEKEEPER_FRAME_ALIGNMENT);
+}
+
+TEST(FrameTest, VerifyResponseRetry) {
+    VerifyResponse msg;
+    msg.user_id = USER_ID;
+    msg.SetRetryTimeout(30000);
+
+    uint64_t frame[8];
+    uint32_t size = msg.SerializeFrame(reinterpret_cast<uint8_t *>(frame), sizeof(frame));
+    ASSERT_EQ(sizeof(gatekeeper::gatekeeper_frame_header_t), size);
+
+    VerifyResponse deserialized;
+    ASSERT_EQ(gatekeeper::ERROR_RETRY,
+            deserialized.DeserializeFrame(reinterpret_cast<uint8_t *>(frame), size));
+    ASSERT_EQ((uint32_t) 30000, deserialized.retry_timeout);
+    ASSERT_EQ(USER_ID, deserialized.user_id);
+}
+
+TEST(FrameTest, RejectsMalformed) {
+    UniquePtr<SizedBuffer> auth_token(make_buffer(20));
+    VerifyResponse msg(USER_ID, auth_token.get());
+    msg.request_reenroll = true;
+
+    uint64_t frame[16];
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(frame);
+    uint32_t size = msg.SerializeFrame(bytes, sizeof(frame));
+    ASSERT_GE(sizeof(frame), size);
+
+    VerifyResponse deserialized;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, deserialized.DeserializeFrame(bytes, size));
+    ASSERT_TRUE(deserialized.request_reenroll);
+    ASSERT_EQ((uint32_t) 20, deserialized.auth_token.length);
+
+    // truncated, wrong message type and misaligned input
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, deserialized.DeserializeFrame(bytes, size - 8));
+    VerifyRequest request;
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, request.DeserializeFrame(bytes, size));
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, deserialized.DeserializeFrame(bytes + 1, size - 1));
+
+    // buffer lengths must account for the frame length exactly
+    gatekeeper::gatekeeper_frame_header_t *header =
+            reinterpret_cast<gatekeeper::gatekeeper_frame_header_t *>(bytes);
+    uint32_t *lengths = reinterpret_cast<uint32_t *>(bytes + sizeof(*header) + 8);
+    lengths[0] = 0xfffffff0;
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, deserialized.DeserializeFrame(bytes, size));
+    lengths[0] = 20;
+    header->version = gatekeeper::GATEKEEPER_FRAME_VERSION + 1;
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, deserialized.DeserializeFrame(bytes, size));
+}
+
+static SizedBuffer *serialize(const gatekeeper::GateKeeperMessage &msg) {
+    SizedBuffer *serialized = new SizedBuffer(msg.GetSerializedSize());
+    msg.Serialize(serialized->buffer.get(), serialized->buffer.get() + serialized->length);
+    return serialized;
+}
+
+static void expect_same_serialization(const gatekeeper::GateKeeperMessage &expected,
+        const gatekeeper::GateKeeperMessage &actual) {
+    UniquePtr<SizedBuffer> a(serialize(expected));
+    UniquePtr<SizedBuffer> b(serialize(actual));
+    ASSERT_EQ(a->length, b->length);
+    ASSERT_EQ(0, memcmp(a->buffer.get(), b->buffer.get(), a->length));
+}
+
+TEST(CompactTest, RoundTrip) {
+    const uint32_t handle_size = sizeof(gatekeeper::password_handle_t);
+    UniquePtr<SizedBuffer> handle(make_buffer(handle_size)), enrolled(make_buffer(16)),
+            provided(make_buffer(gatekeeper::COMPACT_PASSWORD_INLINE_LENGTH));
+    EnrollRequest enroll_request(USER_ID, handle.get(), enrolled.get(), provided.get());
+    gatekeeper::compact_enroll_request_t compact_enroll_request;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(enroll_request, &compact_enroll_request));
+    EnrollRequest expanded_enroll_request;
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            ExpandMessage(compact_enroll_request, &expanded_enroll_request));
+    expect_same_serialization(enroll_request, expanded_enroll_request);
+    // the buffers are views of the compact storage
+    ASSERT_EQ(compact_enroll_request.provided_password.data,
+            expanded_enroll_request.provided_password.Data());
+
+    handle.reset(make_buffer(handle_size));
+    EnrollResponse enroll_response(USER_ID, handle.get());
+    gatekeeper::compact_enroll_response_t compact_enroll_response;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(enroll_response, &compact_enroll_response));
+    EnrollResponse expanded_enroll_response;
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            ExpandMessage(compact_enroll_response, &expanded_enroll_response));
+    expect_same_serialization(enroll_response, expanded_enroll_response);
+
+    handle.reset(make_buffer(handle_size));
+    provided.reset(make_buffer(8));
+    VerifyRequest verify_request(USER_ID, 42, handle.get(), provided.get());
+    gatekeeper::compact_verify_request_t compact_verify_request;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(verify_request, &compact_verify_request));
+    VerifyRequest expanded_verify_request;
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            ExpandMessage(compact_verify_request, &expanded_verify_request));
+    expect_same_serialization(verify_request, expanded_verify_request);
+
+    UniquePtr<SizedBuffer> auth_token(make_buffer(sizeof(hw_auth_token_t)));
+    VerifyResponse verify_response(USER_ID, auth_token.get());
+    verify_response.request_reenroll = true;
+    gatekeeper::compact_verify_response_t compact_verify_response;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(verify_response, &compact_verify_response));
+    VerifyResponse expanded_verify_response;
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            ExpandMessage(compact_verify_response, &expanded_verify_response));
+    expect_same_serialization(verify_response, expanded_verify_response);
+
+    VerifyResponse retry;
+    retry.SetRetryTimeout(30000);
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(retry, &compact_verify_response));
+    ASSERT_EQ(gatekeeper::ERROR_NONE,
+            ExpandMessage(compact_verify_response, &expanded_verify_response));
+    expect_same_serialization(retry, expanded_verify_response);
+    ASSERT_EQ((uint32_t) 0, expanded_verify_response.auth_token.length);
+}
+
+TEST(CompactTest, LongBuffersGoToHeap) {
+    const uint32_t long_length = gatekeeper::COMPACT_PASSWORD_INLINE_LENGTH + 1;
+    UniquePtr<SizedBuffer> handle(make_buffer(32)), password(make_buffer(long_length));
+    VerifyRequest msg(USER_ID, 7, handle.get(), password.get());
+    gatekeeper::compact_verify_request_t compact;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(msg, &compact));
+    ASSERT_EQ(long_length, compact.provided_password.length);
+    ASSERT_EQ(long_length, compact.provided_password.overflow.length);
+
+    VerifyRequest expanded;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, ExpandMessage(compact, &expanded));
+    expect_same_serialization(msg, expanded);
+    ASSERT_EQ(compact.password_handle.data, expanded.password_handle.Data());
+    ASSERT_EQ(compact.provided_password.overflow.Data(), expanded.provided_password.Data());
+
+    // a short value replacing it goes back inline, and nothing of the long one is left
+    handle.reset(make_buffer(32));
+    password.reset(make_buffer(8));
+    VerifyRequest short_msg(USER_ID, 8, handle.get(), password.get());
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(short_msg, &compact));
+    ASSERT_EQ(NULL, compact.provided_password.overflow.Data());
+    ASSERT_EQ(gatekeeper::ERROR_NONE, ExpandMessage(compact, &expanded));
+    expect_same_serialization(short_msg, expanded);
+    ASSERT_EQ(compact.provided_password.data, expanded.provided_password.Data());
+}
+
+TEST(CompactTest, RejectsCorruptLengths) {
+    UniquePtr<SizedBuffer> handle(make_buffer(32)), password(make_buffer(8));
+    VerifyRequest msg(USER_ID, 42, handle.get(), password.get());
+    gatekeeper::compact_verify_request_t compact;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(msg, &compact));
+    compact.provided_password.length = sizeof(compact.provided_password.data) + 1;
+
+    VerifyRequest expanded;
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, ExpandMessage(compact, &expanded));
+    // nothing is left pointing into the compact storage
+    ASSERT_EQ((uint64_t) 0, expanded.challenge);
+    ASSERT_EQ(NULL, expanded.password_handle.Data());
+    ASSERT_EQ(NULL, expanded.provided_password.Data());
+
+    UniquePtr<SizedBuffer> auth_token(make_buffer(sizeof(hw_auth_token_t)));
+    VerifyResponse response(USER_ID, auth_token.get());
+    gatekeeper::compact_verify_response_t compact_response;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(response, &compact_response));
+    compact_response.auth_token.length = UINT32_MAX;
+    VerifyResponse expanded_response;
+    ASSERT_EQ(gatekeeper::ERROR_INVALID, ExpandMessage(compact_response, &expanded_response));
+    ASSERT_EQ((uint32_t) 0, expanded_response.auth_token.length);
+}
+
+TEST(CompactTest, UnknownErrorCodes) {
+    VerifyResponse response;
+    response.error = gatekeeper::ERROR_INVALID;
+    gatekeeper::compact_verify_response_t compact;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(response, &compact));
+    compact.error = 99;
+    VerifyResponse expanded;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, ExpandMessage(compact, &expanded));
+    ASSERT_EQ(gatekeeper::ERROR_UNKNOWN, expanded.error);
+
+    EnrollResponse enroll_response;
+    enroll_response.error = gatekeeper::ERROR_INVALID;
+    gatekeeper::compact_enroll_response_t compact_enroll;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, CompactMessage(enroll_response, &compact_enroll));
+    compact_enroll.error = 99;
+    EnrollResponse expanded_enroll;
+    ASSERT_EQ(gatekeeper::ERROR_NONE, ExpandMessage(compact_enroll, &expanded_enroll));
+    ASSERT_EQ(gatekeeper::ERROR_UNKNOWN, expanded_enroll.error);
+}
+
 uint8_t msgbuf[] = {
     220, 88,  183, 255, 71,  1,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
     0,   173, 0,   0,   0,   228, 174, 98,  187, 191, 135, 253, 200, 51,  230, 114, 247, 151, 109,
@@ -303,10 +762,48 @@ template <typename Message> void parse_garbage() {
     }
 }
 
+/*
+ * Same for the framed format: garbage at every offset of msgbuf, copied to an
+ * aligned buffer and given a valid version and the expected type.
+ */
+template <typename Message> void parse_garbage_frame() {
+    Message msg;
+    uint32_t array_length = sizeof(msgbuf) / sizeof(msgbuf[0]);
+    uint64_t frame[sizeof(msgbuf) / sizeof(uint64_t) + 1];
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(frame);
+    for (uint32_t i = 0; i + sizeof(gatekeeper::gatekeeper_frame_header_t) < array_length; ++i) {
+        uint32_t length = array_length - i;
+        memcpy(bytes, msgbuf + i, length);
+        gatekeeper::gatekeeper_frame_header_t *header =
+                reinterpret_cast<gatekeeper::gatekeeper_frame_header_t *>(bytes);
+        header->version = gatekeeper::GATEKEEPER_FRAME_VERSION;
+        header->type = msg.GetFrameType();
+        msg.DeserializeFrame(bytes, length);
+    }
+}
+
+/*
+ * And through the fuzz target, whose round trip checks abort on failure.
+ */
+template <typename Message> void fuzz_garbage() {
+    uint32_t array_length = sizeof(msgbuf) / sizeof(msgbuf[0]);
+    for (uint32_t i = 0; i < array_length; ++i) {
+        for (uint32_t length = 0; i + length <= array_length; length += 7) {
+            gatekeeper::FuzzMessage<Message>(msgbuf + i, length);
+        }
+    }
+}
+
 #define GARBAGE_TEST(Message)                                                                      \
-    TEST(GarbageTest, Message) { parse_garbage<Message>(); }
+    TEST(GarbageTest, Message) {                                                                   \
+        parse_garbage<Message>();                                                                  \
+        parse_garbage_frame<Message>();                                                            \
+        fuzz_garbage<Message>();                                                                   \
+    }
 
 GARBAGE_TEST(VerifyRequest);
 GARBAGE_TEST(VerifyResponse);
 GARBAGE_TEST(EnrollRequest);
 GARBAGE_TEST(EnrollResponse);
+GARBAGE_TEST(GetStatsRequest);
+GARBAGE_TEST(GetStatsResponse);
@@ -0,0 +1,1381 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gatekeeper/gatekeeper_impl.h>
+
+#include "fake_gatekeeper.h"
+
+using ::gatekeeper::EnrollRequest;
+using ::gatekeeper::EnrollResponse;
+using ::gatekeeper::FakeGateKeeper;
+using ::gatekeeper::SizedBuffer;
+using ::gatekeeper::VerifyRequest;
+using ::gatekeeper::VerifyResponse;
+using ::gatekeeper::GateKeeperObserver;
+using ::gatekeeper::GetStatsRequest;
+using ::gatekeeper::GetStatsResponse;
+using ::gatekeeper::failure_record_t;
+using ::gatekeeper::gatekeeper_phase_t;
+using ::gatekeeper::password_handle_t;
+using ::gatekeeper::password_kdf_params_t;
+using ::gatekeeper::secure_id_t;
+
+static const uint32_t USER_ID = 400;
+
+static SizedBuffer *make_password(const char *password) {
+    uint32_t length = strlen(password);
+    SizedBuffer *result = new SizedBuffer(length);
+    memcpy(result->buffer.get(), password, length);
+    return result;
+}
+
+static void enroll(FakeGateKeeper *gatekeeper, const char *password, EnrollResponse *response) {
+    UniquePtr<SizedBuffer> provided(make_password(password));
+    EnrollRequest request(USER_ID, NULL, provided.get(), NULL);
+    gatekeeper->Enroll(request, response);
+}
+
+static void make_verify_request(const SizedBuffer &handle, uint32_t uid, uint64_t challenge,
+        const char *password, VerifyRequest *request) {
+    request->user_id = uid;
+    request->challenge = challenge;
+    request->password_handle.buffer.reset(new uint8_t[handle.length]);
+    request->password_handle.length = handle.length;
+    memcpy(request->password_handle.buffer.get(), handle.Data(), handle.length);
+    UniquePtr<SizedBuffer> provided(make_password(password));
+    request->provided_password.buffer.reset(provided->buffer.release());
+    request->provided_password.length = provided->length;
+}
+
+static void verify(FakeGateKeeper *gatekeeper, const SizedBuffer &handle, const char *password,
+        VerifyResponse *response) {
+    SizedBuffer handle_copy(handle.length);
+    memcpy(handle_copy.buffer.get(), handle.Data(), handle.length);
+    UniquePtr<SizedBuffer> provided(make_password(password));
+    VerifyRequest request(USER_ID, 0, &handle_copy, provided.get());
+    gatekeeper->Verify(request, response);
+}
+
+TEST(GateKeeperTest, EnrollAndVerify) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    ASSERT_EQ(::gatekeeper::HANDLE_LENGTH_MIN, enroll_response.enrolled_password_handle.length);
+
+    VerifyResponse response;
+    verify(&gatekeeper, enroll_response.enrolled_password_handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ(sizeof(hw_auth_token_t), response.auth_token.length);
+
+    VerifyResponse bad_response;
+    verify(&gatekeeper, enroll_response.enrolled_password_handle, "drowssap", &bad_response);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, bad_response.error);
+}
+
+TEST(GateKeeperTest, RejectsMalformedHandles) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    int reads = gatekeeper.record_reads;
+    int writes = gatekeeper.record_writes;
+    int fetches = gatekeeper.password_key_fetches;
+
+    SizedBuffer short_handle(::gatekeeper::HANDLE_LENGTH_MIN - 1);
+    memcpy(short_handle.buffer.get(), handle.Data(), short_handle.length);
+    SizedBuffer unknown_flags(handle.length);
+    memcpy(unknown_flags.buffer.get(), handle.Data(), handle.length);
+    reinterpret_cast<password_handle_t *>(unknown_flags.buffer.get())->flags |= 2;
+    SizedBuffer foreign(handle.length);
+    memcpy(foreign.buffer.get(), handle.Data(), handle.length);
+    foreign.buffer[offsetof(password_handle_t, hardware_backed)] = 1;
+    SizedBuffer future(handle.length);
+    memcpy(future.buffer.get(), handle.Data(), handle.length);
+    reinterpret_cast<password_handle_t *>(future.buffer.get())->version =
+            ::gatekeeper::HANDLE_VERSION + 1;
+
+    const SizedBuffer *handles[] = { &short_handle, &unknown_flags, &foreign, &future };
+    for (size_t i = 0; i < sizeof(handles) / sizeof(handles[0]); i++) {
+        VerifyResponse response;
+        verify(&gatekeeper, *handles[i], "password", &response);
+        ASSERT_EQ(::gatekeeper::ERROR_INVALID_HANDLE, response.error) << i;
+
+        SizedBuffer current(handles[i]->length);
+        memcpy(current.buffer.get(), handles[i]->Data(), handles[i]->length);
+        UniquePtr<SizedBuffer> provided(make_password("new"));
+        UniquePtr<SizedBuffer> enrolled(make_password("password"));
+        EnrollRequest request(USER_ID, &current, provided.get(), enrolled.get());
+        EnrollResponse reenroll;
+        gatekeeper.Enroll(request, &reenroll);
+        ASSERT_EQ(::gatekeeper::ERROR_INVALID_HANDLE, reenroll.error) << i;
+    }
+
+    // rejected before any storage I/O or crypto
+    ASSERT_EQ(reads, gatekeeper.record_reads);
+    ASSERT_EQ(writes, gatekeeper.record_writes);
+    ASSERT_EQ(fetches, gatekeeper.password_key_fetches);
+}
+
+static void reuse_request(const EnrollRequest &from, EnrollRequest *to) {
+    std::vector<uint8_t> serialized(from.GetSerializedSize());
+    from.Serialize(&serialized[0], &serialized[0] + serialized.size());
+    to->Reset();
+    ASSERT_EQ(::gatekeeper::ERROR_NONE,
+            to->Deserialize(&serialized[0], &serialized[0] + serialized.size()));
+}
+
+TEST(GateKeeperTest, ReusedRequest) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enrolled_response;
+    enroll(&gatekeeper, "password", &enrolled_response);
+    const SizedBuffer &handle = enrolled_response.enrolled_password_handle;
+
+    EnrollRequest reused;
+    {
+        SizedBuffer *current = new SizedBuffer(handle.length);
+        memcpy(current->buffer.get(), handle.Data(), handle.length);
+        UniquePtr<SizedBuffer> handle_copy(current);
+        UniquePtr<SizedBuffer> provided(make_password("new"));
+        UniquePtr<SizedBuffer> enrolled(make_password("password"));
+        EnrollRequest request(USER_ID, handle_copy.get(), provided.get(), enrolled.get());
+        reuse_request(request, &reused);
+    }
+    EnrollResponse changed;
+    gatekeeper.Enroll(reused, &changed);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, changed.error);
+
+    // the buffers kept from the last request hold nothing, so there is no handle
+    {
+        UniquePtr<SizedBuffer> provided(make_password("password"));
+        EnrollRequest request(USER_ID, NULL, provided.get(), NULL);
+        reuse_request(request, &reused);
+    }
+    ASSERT_EQ(NULL, reused.password_handle.Data());
+    EnrollResponse untrusted;
+    gatekeeper.Enroll(reused, &untrusted);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, untrusted.error);
+
+    // and no password either
+    {
+        SizedBuffer empty;
+        EnrollRequest request(USER_ID, NULL, &empty, NULL);
+        reuse_request(request, &reused);
+    }
+    ASSERT_EQ(NULL, reused.provided_password.Data());
+    EnrollResponse no_password;
+    gatekeeper.Enroll(reused, &no_password);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, no_password.error);
+}
+
+TEST(GateKeeperTest, ReusedResponse) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll_response.SetRetryTimeout(30000);
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    ASSERT_EQ((uint32_t) 0, enroll_response.retry_timeout);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    // what a failed attempt left in the response doesn't leak into the next one
+    VerifyResponse response;
+    response.SetRetryTimeout(30000);
+    response.request_reenroll = true;
+    verify(&gatekeeper, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ((uint32_t) 0, response.retry_timeout);
+    ASSERT_FALSE(response.request_reenroll);
+    ASSERT_EQ(sizeof(hw_auth_token_t), response.auth_token.length);
+
+    response.error = ::gatekeeper::ERROR_INVALID;
+    VerifyRequest request;
+    make_verify_request(handle, USER_ID, 0, "password", &request);
+    ASSERT_TRUE(gatekeeper.VerifyAsync(request, &response));
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+}
+
+TEST(GateKeeperTest, StreamingSignatureMatchesOneShot) {
+    FakeGateKeeper one_shot, streaming;
+    streaming.streaming = true;
+
+    EnrollResponse one_shot_response, streaming_response;
+    enroll(&one_shot, "password", &one_shot_response);
+    enroll(&streaming, "password", &streaming_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, one_shot_response.error);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, streaming_response.error);
+
+    const password_handle_t *a = reinterpret_cast<const password_handle_t *>(
+            one_shot_response.enrolled_password_handle.Data());
+    const password_handle_t *b = reinterpret_cast<const password_handle_t *>(
+            streaming_response.enrolled_password_handle.Data());
+    ASSERT_EQ(0, memcmp(a->signature, b->signature, sizeof(a->signature)));
+
+    // handles are interchangeable between the two signing paths
+    VerifyResponse response;
+    verify(&one_shot, streaming_response.enrolled_password_handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+}
+
+TEST(GateKeeperTest, PreparedPasswordKey) {
+    FakeGateKeeper raw, prepared;
+    prepared.prepared_key = true;
+
+    EnrollResponse raw_response, prepared_response;
+    enroll(&raw, "password", &raw_response);
+    enroll(&prepared, "password", &prepared_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, raw_response.error);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, prepared_response.error);
+
+    const password_handle_t *a = reinterpret_cast<const password_handle_t *>(
+            raw_response.enrolled_password_handle.Data());
+    const password_handle_t *b = reinterpret_cast<const password_handle_t *>(
+            prepared_response.enrolled_password_handle.Data());
+    ASSERT_EQ(0, memcmp(a->signature, b->signature, sizeof(a->signature)));
+
+    VerifyResponse response;
+    verify(&prepared, raw_response.enrolled_password_handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    VerifyResponse wrong;
+    verify(&prepared, raw_response.enrolled_password_handle, "wrong", &wrong);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, wrong.error);
+
+    // the key schedule is only computed once
+    ASSERT_EQ(1, prepared.password_key_preparations);
+}
+
+TEST(GateKeeperTest, HandleLength) {
+    // handles only grow by the KDF parameters when they record them
+    FakeGateKeeper legacy;
+    EnrollResponse legacy_response;
+    enroll(&legacy, "password", &legacy_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, legacy_response.error);
+    ASSERT_EQ(::gatekeeper::HANDLE_LENGTH_MIN, legacy_response.enrolled_password_handle.length);
+    ASSERT_EQ(HANDLE_VERSION_THROTTLE, legacy_response.enrolled_password_handle.Data()[0]);
+
+    FakeGateKeeper kdf;
+    kdf.kdf = true;
+    EnrollResponse kdf_response;
+    enroll(&kdf, "password", &kdf_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, kdf_response.error);
+    ASSERT_EQ(sizeof(password_handle_t), kdf_response.enrolled_password_handle.length);
+    ASSERT_EQ(HANDLE_VERSION_KDF, kdf_response.enrolled_password_handle.Data()[0]);
+
+    VerifyResponse legacy_verified, kdf_verified;
+    verify(&legacy, legacy_response.enrolled_password_handle, "password", &legacy_verified);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, legacy_verified.error);
+    verify(&kdf, kdf_response.enrolled_password_handle, "password", &kdf_verified);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, kdf_verified.error);
+}
+
+TEST(GateKeeperTest, PasswordKdf) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.kdf = true;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    const password_handle_t *password_handle =
+            reinterpret_cast<const password_handle_t *>(handle.Data());
+    ASSERT_EQ(HANDLE_VERSION_KDF, password_handle->version);
+    ASSERT_EQ(0, memcmp(&gatekeeper.kdf_params, &password_handle->kdf,
+            sizeof(password_kdf_params_t)));
+    ASSERT_EQ(1, gatekeeper.kdf_derivations);
+
+    VerifyResponse response;
+    verify(&gatekeeper, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_FALSE(response.request_reenroll);
+    VerifyResponse wrong;
+    verify(&gatekeeper, handle, "wrong", &wrong);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, wrong.error);
+    ASSERT_EQ(3, gatekeeper.kdf_derivations);
+
+    // the parameters are signed, tampering with them fails verification
+    SizedBuffer tampered(handle.length);
+    memcpy(tampered.buffer.get(), handle.Data(), handle.length);
+    reinterpret_cast<password_handle_t *>(tampered.buffer.get())->kdf.cost++;
+    gatekeeper.Advance(60000);
+    VerifyResponse tampered_response;
+    verify(&gatekeeper, tampered, "password", &tampered_response);
+    ASSERT_NE(::gatekeeper::ERROR_NONE, tampered_response.error);
+
+    // a handle too short to hold its parameters is rejected outright
+    SizedBuffer truncated(sizeof(password_handle_t) - 1);
+    memcpy(truncated.buffer.get(), handle.Data(), truncated.length);
+    VerifyResponse truncated_response;
+    verify(&gatekeeper, truncated, "password", &truncated_response);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID_HANDLE, truncated_response.error);
+}
+
+TEST(GateKeeperTest, PasswordKdfMigration) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse legacy;
+    enroll(&gatekeeper, "password", &legacy);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, legacy.error);
+    ASSERT_EQ(HANDLE_VERSION_THROTTLE, reinterpret_cast<const password_handle_t *>(
+            legacy.enrolled_password_handle.Data())->version);
+
+    gatekeeper.kdf = true;
+    VerifyResponse response;
+    verify(&gatekeeper, legacy.enrolled_password_handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_TRUE(response.request_reenroll);
+
+    SizedBuffer current(legacy.enrolled_password_handle.length);
+    memcpy(current.buffer.get(), legacy.enrolled_password_handle.Data(), current.length);
+    UniquePtr<SizedBuffer> provided(make_password("password"));
+    UniquePtr<SizedBuffer> enrolled(make_password("password"));
+    EnrollRequest request(USER_ID, &current, provided.get(), enrolled.get());
+    EnrollResponse migrated;
+    gatekeeper.Enroll(request, &migrated);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, migrated.error);
+    const password_handle_t *migrated_handle = reinterpret_cast<const password_handle_t *>(
+            migrated.enrolled_password_handle.Data());
+    ASSERT_EQ(HANDLE_VERSION_KDF, migrated_handle->version);
+    ASSERT_EQ(reinterpret_cast<const password_handle_t *>(
+            legacy.enrolled_password_handle.Data())->user_id, migrated_handle->user_id);
+
+    VerifyResponse after;
+    verify(&gatekeeper, migrated.enrolled_password_handle, "password", &after);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, after.error);
+    ASSERT_FALSE(after.request_reenroll);
+
+    // retuning the cost migrates handles again
+    gatekeeper.kdf_params.cost *= 2;
+    VerifyResponse retuned;
+    verify(&gatekeeper, migrated.enrolled_password_handle, "password", &retuned);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, retuned.error);
+    ASSERT_TRUE(retuned.request_reenroll);
+}
+
+static void copy_buffer(const SizedBuffer &from, SizedBuffer *to) {
+    to->buffer.reset(new uint8_t[from.length]);
+    to->length = from.length;
+    memcpy(to->buffer.get(), from.Data(), from.length);
+}
+
+TEST(GateKeeperTest, EnrollBatch) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse legacy[3];
+    for (uint32_t i = 0; i < 3; i++) {
+        UniquePtr<SizedBuffer> provided(make_password("password"));
+        EnrollRequest request(USER_ID + i, NULL, provided.get(), NULL);
+        gatekeeper.Enroll(request, &legacy[i]);
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, legacy[i].error);
+    }
+
+    // migrate the three users, one with the wrong password, and enroll a fourth
+    gatekeeper.kdf = true;
+    gatekeeper.transactions = true;
+    gatekeeper.password_key_fetches = 0;
+    gatekeeper.random_draws = 0;
+    EnrollRequest requests[4];
+    for (uint32_t i = 0; i < 4; i++) {
+        UniquePtr<SizedBuffer> password(make_password(i == 1 ? "wrong" : "password"));
+        requests[i].user_id = USER_ID + i;
+        copy_buffer(*password, &requests[i].provided_password);
+        if (i < 3) {
+            copy_buffer(legacy[i].enrolled_password_handle, &requests[i].password_handle);
+            copy_buffer(*password, &requests[i].enrolled_password);
+        }
+    }
+    EnrollResponse responses[4];
+    gatekeeper.EnrollBatch(requests, 4, responses);
+
+    ASSERT_EQ(1, gatekeeper.password_key_fetches);
+    ASSERT_EQ(1, gatekeeper.random_draws);
+    ASSERT_EQ(2, gatekeeper.commits);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, responses[1].error);
+    ASSERT_EQ((uint32_t) 1, gatekeeper.Record(USER_ID + 1, true)->failure_counter);
+    for (uint32_t i = 0; i < 4; i++) {
+        if (i == 1) continue;
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, responses[i].error) << i;
+        const password_handle_t *handle = reinterpret_cast<const password_handle_t *>(
+                responses[i].enrolled_password_handle.Data());
+        ASSERT_EQ(HANDLE_VERSION_KDF, handle->version);
+        ASSERT_EQ((uint32_t) 0, gatekeeper.Record(USER_ID + i, true)->failure_counter);
+        if (i < 3) {
+            ASSERT_EQ(reinterpret_cast<const password_handle_t *>(
+                    legacy[i].enrolled_password_handle.Data())->user_id, handle->user_id);
+        }
+
+        // each result is usable on its own
+        VerifyRequest request;
+        make_verify_request(responses[i].enrolled_password_handle, USER_ID + i, 0, "password",
+                &request);
+        VerifyResponse response;
+        gatekeeper.Verify(request, &response);
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error) << i;
+    }
+}
+
+TEST(GateKeeperTest, RandomPool) {
+    FakeGateKeeper gatekeeper;
+    // room for the secure id and salt of four enrollments
+    gatekeeper.EnableRandomPool(64, 1000);
+    EnrollResponse responses[6];
+    for (int i = 0; i < 5; i++) {
+        enroll(&gatekeeper, "password", &responses[i]);
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, responses[i].error);
+    }
+    ASSERT_EQ(2, gatekeeper.random_draws);
+
+    // an aged pool is reseeded even with bytes left
+    gatekeeper.Advance(1000);
+    enroll(&gatekeeper, "password", &responses[5]);
+    ASSERT_EQ(3, gatekeeper.random_draws);
+
+    for (int i = 0; i < 6; i++) {
+        const password_handle_t *handle = reinterpret_cast<const password_handle_t *>(
+                responses[i].enrolled_password_handle.Data());
+        for (int j = 0; j < i; j++) {
+            const password_handle_t *other = reinterpret_cast<const password_handle_t *>(
+                    responses[j].enrolled_password_handle.Data());
+            ASSERT_NE(other->user_id, handle->user_id) << i << " " << j;
+            ASSERT_NE(other->salt, handle->salt) << i << " " << j;
+        }
+    }
+
+    VerifyResponse response;
+    verify(&gatekeeper, responses[5].enrolled_password_handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+}
+
+TEST(GateKeeperTest, CalibratePasswordKdf) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.kdf_cost_per_ms = 1000;
+    password_kdf_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.algorithm = PASSWORD_KDF_PBKDF2_HMAC_SHA256;
+    ASSERT_TRUE(gatekeeper.CalibratePasswordKdf(100, &params));
+    ASSERT_GE(params.cost, (uint32_t) 90000);
+    ASSERT_LE(params.cost, (uint32_t) 110000);
+
+    params.algorithm = PASSWORD_KDF_SCRYPT;
+    params.cost = 0;
+    ASSERT_FALSE(gatekeeper.CalibratePasswordKdf(100, &params));
+}
+
+TEST(GateKeeperTest, VerifyBatch) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    const char *passwords[] = { "password", "wrong", "password" };
+    const size_t count = sizeof(passwords) / sizeof(passwords[0]);
+    VerifyRequest requests[count];
+    for (size_t i = 0; i < count; i++) {
+        make_verify_request(handle, USER_ID + i, i, passwords[i], &requests[i]);
+    }
+
+    gatekeeper.password_key_fetches = 0;
+    gatekeeper.auth_token_key_fetches = 0;
+    VerifyResponse responses[count];
+    gatekeeper.VerifyBatch(requests, count, responses);
+
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, responses[0].error);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, responses[1].error);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, responses[2].error);
+    ASSERT_EQ(sizeof(hw_auth_token_t), responses[2].auth_token.length);
+    const hw_auth_token_t *token =
+            reinterpret_cast<const hw_auth_token_t *>(responses[2].auth_token.Data());
+    ASSERT_EQ((uint64_t) 2, token->challenge);
+
+    ASSERT_EQ(1, gatekeeper.password_key_fetches);
+    ASSERT_EQ(1, gatekeeper.auth_token_key_fetches);
+
+    // only the failed request keeps its failure count
+    ASSERT_EQ((uint32_t) 0, gatekeeper.Record(USER_ID, true)->failure_counter);
+    ASSERT_EQ((uint32_t) 1, gatekeeper.Record(USER_ID + 1, true)->failure_counter);
+}
+
+TEST(GateKeeperTest, VerifyBatchTransactions) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    gatekeeper.transactions = true;
+
+    const size_t count = 3;
+    VerifyRequest requests[count];
+    for (size_t i = 0; i < count; i++) {
+        make_verify_request(handle, USER_ID + i, i, "password", &requests[i]);
+    }
+
+    // one commit for the increments, one for the clears
+    VerifyResponse responses[count];
+    gatekeeper.VerifyBatch(requests, count, responses);
+    for (size_t i = 0; i < count; i++) {
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, responses[i].error);
+    }
+    ASSERT_EQ(2, gatekeeper.commits);
+
+    // if the increments can't be committed no password is checked
+    gatekeeper.fail_commit = true;
+    VerifyResponse failed_responses[count];
+    gatekeeper.VerifyBatch(requests, count, failed_responses);
+    for (size_t i = 0; i < count; i++) {
+        ASSERT_EQ(::gatekeeper::ERROR_UNKNOWN, failed_responses[i].error);
+        ASSERT_EQ((uint32_t) 0, failed_responses[i].auth_token.length);
+    }
+    ASSERT_EQ(3, gatekeeper.commits);
+}
+
+TEST(GateKeeperTest, VerifyAsync) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    // without an asynchronous commit it is just Verify
+    VerifyRequest request;
+    make_verify_request(handle, USER_ID, 42, "password", &request);
+    VerifyResponse sync_response;
+    ASSERT_TRUE(gatekeeper.VerifyAsync(request, &sync_response));
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, sync_response.error);
+    ASSERT_EQ(sizeof(hw_auth_token_t), sync_response.auth_token.length);
+
+    gatekeeper.transactions = true;
+    gatekeeper.async_commit = true;
+    VerifyResponse response;
+    ASSERT_FALSE(gatekeeper.VerifyAsync(request, &response));
+    ASSERT_EQ(1, gatekeeper.started_commits);
+    ASSERT_EQ((uint32_t) 1, gatekeeper.Record(USER_ID, true)->failure_counter);
+    // no token before the increment is durable
+    ASSERT_EQ((uint32_t) 0, response.auth_token.length);
+
+    // one verification at a time, and nothing else touches failure records meanwhile
+    int reads = gatekeeper.record_reads;
+    int writes = gatekeeper.record_writes;
+    VerifyResponse busy;
+    ASSERT_TRUE(gatekeeper.VerifyAsync(request, &busy));
+    ASSERT_EQ(::gatekeeper::ERROR_UNKNOWN, busy.error);
+    VerifyResponse busy_verify;
+    gatekeeper.Verify(request, &busy_verify);
+    ASSERT_EQ(::gatekeeper::ERROR_UNKNOWN, busy_verify.error);
+    EnrollResponse busy_enroll;
+    enroll(&gatekeeper, "password", &busy_enroll);
+    ASSERT_EQ(::gatekeeper::ERROR_UNKNOWN, busy_enroll.error);
+    SizedBuffer serialized(request.GetSerializedSize());
+    request.Serialize(serialized.buffer.get(), serialized.buffer.get() + serialized.length);
+    uint8_t out[256];
+    uint32_t size = gatekeeper.HandleMessage(::gatekeeper::VERIFY, serialized.buffer.get(),
+            serialized.length, out, sizeof(out));
+    VerifyResponse busy_message;
+    ASSERT_EQ(::gatekeeper::ERROR_UNKNOWN, busy_message.Deserialize(out, out + size));
+    ASSERT_EQ(reads, gatekeeper.record_reads);
+    ASSERT_EQ(writes, gatekeeper.record_writes);
+
+    // the password was checked while the commit was in flight, its key isn't needed again
+    int fetches = gatekeeper.password_key_fetches;
+    ASSERT_EQ(&response, gatekeeper.CompleteVerifyAsync(true));
+    ASSERT_EQ(fetches, gatekeeper.password_key_fetches);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ((uint64_t) 42,
+            reinterpret_cast<const hw_auth_token_t *>(response.auth_token.Data())->challenge);
+    ASSERT_EQ((uint32_t) 0, gatekeeper.Record(USER_ID, true)->failure_counter);
+    ASSERT_EQ(NULL, gatekeeper.CompleteVerifyAsync(true));
+
+    // a commit that fails reveals nothing, even for the right password
+    VerifyResponse failed;
+    ASSERT_FALSE(gatekeeper.VerifyAsync(request, &failed));
+    ASSERT_EQ(&failed, gatekeeper.CompleteVerifyAsync(false));
+    ASSERT_EQ(::gatekeeper::ERROR_UNKNOWN, failed.error);
+    ASSERT_EQ((uint32_t) 0, failed.auth_token.length);
+
+    // a wrong password is only reported once the increment is durable
+    VerifyRequest wrong_request;
+    make_verify_request(handle, USER_ID, 0, "wrong", &wrong_request);
+    VerifyResponse wrong;
+    ASSERT_FALSE(gatekeeper.VerifyAsync(wrong_request, &wrong));
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, wrong.error);
+    gatekeeper.CompleteVerifyAsync(true);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, wrong.error);
+}
+
+TEST(GateKeeperTest, VerifyCache) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.kdf = true;
+    gatekeeper.EnableVerifyCache(1000);
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    int derivations = gatekeeper.kdf_derivations;
+
+    VerifyResponse first;
+    verify(&gatekeeper, handle, "password", &first);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, first.error);
+    ASSERT_EQ(derivations + 1, gatekeeper.kdf_derivations);
+
+    // the same password again skips the KDF, but still gets a token for its challenge
+    VerifyRequest request;
+    make_verify_request(handle, USER_ID, 7, "password", &request);
+    VerifyResponse second;
+    gatekeeper.Verify(request, &second);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, second.error);
+    ASSERT_EQ(derivations + 1, gatekeeper.kdf_derivations);
+    ASSERT_EQ((uint64_t) 7,
+            reinterpret_cast<const hw_auth_token_t *>(second.auth_token.Data())->challenge);
+
+    // a handle sharing the cached signature but not its other fields is checked in full
+    VerifyRequest forged_request;
+    make_verify_request(handle, USER_ID, 7, "password", &forged_request);
+    password_handle_t *forged_handle =
+            reinterpret_cast<password_handle_t *>(forged_request.password_handle.buffer.get());
+    forged_handle->user_id++;
+    forged_handle->flags ^= HANDLE_FLAG_THROTTLE_SECURE;
+    VerifyResponse forged;
+    gatekeeper.Verify(forged_request, &forged);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, forged.error);
+    ASSERT_EQ(derivations + 2, gatekeeper.kdf_derivations);
+
+    // as is a different password, which drops the entry
+    VerifyResponse first_again;
+    verify(&gatekeeper, handle, "password", &first_again);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, first_again.error);
+    ASSERT_EQ(derivations + 3, gatekeeper.kdf_derivations);
+    VerifyResponse wrong;
+    verify(&gatekeeper, handle, "wrong", &wrong);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, wrong.error);
+    ASSERT_EQ(derivations + 4, gatekeeper.kdf_derivations);
+    VerifyResponse third;
+    verify(&gatekeeper, handle, "password", &third);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, third.error);
+    ASSERT_EQ(derivations + 5, gatekeeper.kdf_derivations);
+
+    // entries expire
+    gatekeeper.Advance(1000);
+    VerifyResponse expired;
+    verify(&gatekeeper, handle, "password", &expired);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, expired.error);
+    ASSERT_EQ(derivations + 6, gatekeeper.kdf_derivations);
+
+    // and are dropped when the user enrolls
+    EnrollResponse reenrolled;
+    enroll(&gatekeeper, "password", &reenrolled);
+    derivations = gatekeeper.kdf_derivations;
+    VerifyResponse old_handle;
+    verify(&gatekeeper, handle, "password", &old_handle);
+    ASSERT_EQ(derivations + 1, gatekeeper.kdf_derivations);
+}
+
+static const uint32_t NEVER_THROTTLE[] = { 0 };
+
+/**
+ * FakeGateKeeper hosted in a multi-threaded HAL: each storage access is
+ * atomic on its own, but a read-modify-write of a record is not.
+ */
+class ConcurrentGateKeeper : public FakeGateKeeper {
+public:
+    ConcurrentGateKeeper() {
+        EnableConcurrentRequests();
+        SetThrottleSchedule(NEVER_THROTTLE, 1);
+        // widens the window between reading and writing back a record
+        storage_latency_us = 10;
+    }
+
+protected:
+    virtual void LockUser(uint32_t uid) { user_locks[uid % 4].lock(); }
+    virtual void UnlockUser(uint32_t uid) { user_locks[uid % 4].unlock(); }
+
+    virtual bool GetFailureRecord(uint32_t uid, secure_id_t user_id, failure_record_t *record,
+            bool secure) {
+        std::lock_guard<std::mutex> lock(storage_lock);
+        return FakeGateKeeper::GetFailureRecord(uid, user_id, record, secure);
+    }
+
+    virtual bool ClearFailureRecord(uint32_t uid, secure_id_t user_id, bool secure) {
+        std::lock_guard<std::mutex> lock(storage_lock);
+        return FakeGateKeeper::ClearFailureRecord(uid, user_id, secure);
+    }
+
+    virtual bool WriteFailureRecord(uint32_t uid, failure_record_t *record, bool secure) {
+        std::lock_guard<std::mutex> lock(storage_lock);
+        return FakeGateKeeper::WriteFailureRecord(uid, record, secure);
+    }
+
+    virtual void GetPasswordKey(const uint8_t **password_key, uint32_t *length) {
+        std::lock_guard<std::mutex> lock(storage_lock);
+        FakeGateKeeper::GetPasswordKey(password_key, length);
+    }
+
+    virtual bool GetAuthTokenKey(const uint8_t **auth_token_key, uint32_t *length) const {
+        std::lock_guard<std::mutex> lock(storage_lock);
+        return FakeGateKeeper::GetAuthTokenKey(auth_token_key, length);
+    }
+
+private:
+    std::mutex user_locks[4];
+    mutable std::mutex storage_lock;
+};
+
+TEST(GateKeeperTest, ConcurrentRequests) {
+    ConcurrentGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    // two threads per user, whose attempts must serialize for the counts to add up
+    const uint32_t threads = 8;
+    const uint32_t attempts = 100;
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&gatekeeper, &handle, t, attempts] {
+            for (uint32_t i = 0; i < attempts; i++) {
+                VerifyRequest request;
+                make_verify_request(handle, USER_ID + t / 2, 0, "wrong", &request);
+                VerifyResponse response;
+                gatekeeper.Verify(request, &response);
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    for (uint32_t t = 0; t < threads; t += 2) {
+        ASSERT_EQ(2 * attempts, gatekeeper.Record(USER_ID + t / 2, true)->failure_counter);
+    }
+    GetStatsResponse stats;
+    gatekeeper.GetStats(GetStatsRequest(USER_ID), &stats);
+    ASSERT_EQ(threads * attempts, stats.stats.verify_requests);
+    ASSERT_EQ(threads * attempts, stats.stats.verify_failures);
+
+    VerifyResponse response;
+    verify(&gatekeeper, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ((uint32_t) 0, gatekeeper.Record(USER_ID, true)->failure_counter);
+}
+
+// The branchy policy the default throttle schedule was derived from
+static uint32_t reference_retry_timeout(uint32_t failure_counter) {
+    static const int failure_timeout_ms = 30000;
+    if (failure_counter == 0) return 0;
+
+    if (failure_counter > 0 && failure_counter <= 10) {
+        return failure_counter % 5 == 0 ? failure_timeout_ms : 0;
+    } else if (failure_counter < 30) {
+        return failure_timeout_ms;
+    } else if (failure_counter < 140) {
+        return failure_timeout_ms << ((failure_counter - 30) / 10);
+    }
+
+    return 1000 * 60 * 60 * 24;
+}
+
+TEST(GateKeeperTest, DefaultThrottleSchedule) {
+    FakeGateKeeper gatekeeper;
+    failure_record_t record;
+    memset(&record, 0, sizeof(record));
+    for (uint32_t i = 0; i < 1000; i++) {
+        record.failure_counter = i;
+        ASSERT_EQ(reference_retry_timeout(i), gatekeeper.ComputeRetryTimeout(&record)) << i;
+    }
+    record.failure_counter = UINT32_MAX;
+    ASSERT_EQ(::gatekeeper::THROTTLE_MAX_TIMEOUT_MS, gatekeeper.ComputeRetryTimeout(&record));
+
+    const uint32_t *timeouts;
+    uint32_t length;
+    gatekeeper.GetThrottleSchedule(&timeouts, &length);
+    ASSERT_EQ(::gatekeeper::DEFAULT_THROTTLE_SCHEDULE, timeouts);
+    ASSERT_EQ(::gatekeeper::DEFAULT_THROTTLE_SCHEDULE_LENGTH, length);
+}
+
+TEST(GateKeeperTest, CustomThrottleSchedule) {
+    static const uint32_t schedule[] = { 0, 0, 0, 1000, 0xFFFFFFFF };
+    FakeGateKeeper gatekeeper;
+    gatekeeper.SetThrottleSchedule(schedule, sizeof(schedule) / sizeof(schedule[0]));
+
+    failure_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.failure_counter = 2;
+    ASSERT_EQ((uint32_t) 0, gatekeeper.ComputeRetryTimeout(&record));
+    record.failure_counter = 3;
+    ASSERT_EQ((uint32_t) 1000, gatekeeper.ComputeRetryTimeout(&record));
+    // past the end, clamped to the maximum
+    record.failure_counter = 50;
+    ASSERT_EQ(::gatekeeper::THROTTLE_MAX_TIMEOUT_MS, gatekeeper.ComputeRetryTimeout(&record));
+
+    gatekeeper.SetThrottleSchedule(NULL, 0);
+    record.failure_counter = 5;
+    ASSERT_EQ((uint32_t) 30000, gatekeeper.ComputeRetryTimeout(&record));
+}
+
+TEST(GateKeeperTest, FastVerify) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.EnableFastVerify();
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    gatekeeper.record_writes = 0;
+    gatekeeper.record_clears = 0;
+
+    // successful attempts from a clean record cost one write each and no clear
+    for (int i = 0; i < 3; i++) {
+        VerifyResponse response;
+        verify(&gatekeeper, handle, "password", &response);
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    }
+    ASSERT_EQ(3, gatekeeper.record_writes);
+    ASSERT_EQ(0, gatekeeper.record_clears);
+    ASSERT_EQ((uint32_t) 1, gatekeeper.Record(USER_ID, true)->failure_counter);
+
+    // the stale count is not charged to the next failure
+    VerifyResponse bad_response;
+    verify(&gatekeeper, handle, "wrong", &bad_response);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, bad_response.error);
+    ASSERT_EQ((uint32_t) 1, gatekeeper.Record(USER_ID, true)->failure_counter);
+
+    // a real failure is cleared durably by the next success
+    VerifyResponse response;
+    verify(&gatekeeper, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ(1, gatekeeper.record_clears);
+    ASSERT_EQ((uint32_t) 0, gatekeeper.Record(USER_ID, true)->failure_counter);
+}
+
+TEST(GateKeeperTest, FastVerifyForgotten) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.EnableFastVerify();
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    VerifyResponse response;
+    verify(&gatekeeper, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+
+    // a new instance, as after a reboot, takes the stale count at face value
+    FakeGateKeeper rebooted;
+    rebooted.EnableFastVerify();
+    *rebooted.Record(USER_ID, true) = *gatekeeper.Record(USER_ID, true);
+    VerifyResponse bad_response;
+    verify(&rebooted, handle, "wrong", &bad_response);
+    ASSERT_EQ((uint32_t) 2, rebooted.Record(USER_ID, true)->failure_counter);
+}
+
+TEST(GateKeeperTest, FastVerifyManyUsers) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.EnableFastVerify();
+    // more users than fast verification tracks
+    const uint32_t users = 12;
+    EnrollResponse handles[users];
+    for (uint32_t i = 0; i < users; i++) {
+        UniquePtr<SizedBuffer> provided(make_password("password"));
+        EnrollRequest request(USER_ID + i, NULL, provided.get(), NULL);
+        gatekeeper.Enroll(request, &handles[i]);
+        ASSERT_EQ(::gatekeeper::ERROR_NONE, handles[i].error);
+    }
+
+    for (int round = 0; round < 2; round++) {
+        for (uint32_t i = 0; i < users; i++) {
+            VerifyRequest request;
+            make_verify_request(handles[i].enrolled_password_handle, USER_ID + i, 0, "password",
+                    &request);
+            VerifyResponse response;
+            gatekeeper.Verify(request, &response);
+            ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+        }
+    }
+
+    // whether or not a user took the fast path, no success is charged to the next failure
+    for (uint32_t i = 0; i < users; i++) {
+        VerifyRequest request;
+        make_verify_request(handles[i].enrolled_password_handle, USER_ID + i, 0, "wrong",
+                &request);
+        VerifyResponse response;
+        gatekeeper.Verify(request, &response);
+        ASSERT_EQ(::gatekeeper::ERROR_INVALID, response.error);
+        ASSERT_EQ((uint32_t) 1, gatekeeper.Record(USER_ID + i, true)->failure_counter) << i;
+    }
+}
+
+// Fails verification until the record reaches the first non-zero timeout
+static void lock_out(FakeGateKeeper *gatekeeper, const SizedBuffer &handle) {
+    for (int i = 0; i < 5; i++) {
+        VerifyResponse response;
+        verify(gatekeeper, handle, "wrong", &response);
+    }
+    ASSERT_EQ((uint32_t) 5, gatekeeper->Record(USER_ID, true)->failure_counter);
+}
+
+TEST(GateKeeperTest, BootSession) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.boot_session = 1;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    lock_out(&gatekeeper, handle);
+
+    // rebooted, with the clock already past the stored timestamp
+    FakeGateKeeper rebooted;
+    rebooted.boot_session = 2;
+    rebooted.now = gatekeeper.now + 5000;
+    *rebooted.Record(USER_ID, true) = *gatekeeper.Record(USER_ID, true);
+
+    // the window restarts at the first attempt of the new boot, without a write
+    VerifyResponse response;
+    verify(&rebooted, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_RETRY, response.error);
+    ASSERT_EQ((uint32_t) 30000, response.retry_timeout);
+    rebooted.Advance(10000);
+    verify(&rebooted, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_RETRY, response.error);
+    ASSERT_EQ((uint32_t) 20000, response.retry_timeout);
+    ASSERT_EQ(0, rebooted.record_writes);
+
+    // once it expires the next failure is charged and tagged with this boot
+    rebooted.Advance(20000);
+    VerifyResponse bad_response;
+    verify(&rebooted, handle, "wrong", &bad_response);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, bad_response.error);
+    ASSERT_EQ(1, rebooted.record_writes);
+    const failure_record_t *record = rebooted.Record(USER_ID, true);
+    ASSERT_EQ((uint32_t) 6, record->failure_counter);
+    ASSERT_EQ((uint64_t) 2 << 44 | rebooted.now, record->last_checked_timestamp);
+}
+
+TEST(GateKeeperTest, RebootWithoutBootSession) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    lock_out(&gatekeeper, handle);
+
+    // only a clock that went backwards reveals the reboot, and the new
+    // window base has to be written back
+    FakeGateKeeper rebooted;
+    rebooted.now = 10;
+    *rebooted.Record(USER_ID, true) = *gatekeeper.Record(USER_ID, true);
+    VerifyResponse response;
+    verify(&rebooted, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_RETRY, response.error);
+    ASSERT_EQ((uint32_t) 30000, response.retry_timeout);
+    ASSERT_EQ(1, rebooted.record_writes);
+    ASSERT_EQ((uint64_t) 10, rebooted.Record(USER_ID, true)->last_checked_timestamp);
+}
+
+class RecordingObserver : public GateKeeperObserver {
+public:
+    virtual void OnPhaseBegin(gatekeeper_phase_t phase, uint64_t /* timestamp_ns */) {
+        events.push_back(phase);
+    }
+
+    virtual void OnPhaseEnd(gatekeeper_phase_t phase, uint64_t /* timestamp_ns */) {
+        events.push_back(-1 - phase);
+    }
+
+    bool Saw(gatekeeper_phase_t phase) const {
+        for (size_t i = 0; i < events.size(); i++) {
+            if (events[i] == phase) return true;
+        }
+        return false;
+    }
+
+    // begins are recorded as the phase, ends as -1 - phase
+    std::vector<int> events;
+};
+
+TEST(GateKeeperTest, Observer) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+
+    RecordingObserver observer;
+    gatekeeper.SetObserver(&observer);
+    VerifyResponse response;
+    verify(&gatekeeper, enroll_response.enrolled_password_handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+
+    ASSERT_EQ(::gatekeeper::PHASE_VERIFY, observer.events.front());
+    ASSERT_EQ(-1 - ::gatekeeper::PHASE_VERIFY, observer.events.back());
+    ASSERT_TRUE(observer.Saw(::gatekeeper::PHASE_GET_FAILURE_RECORD));
+    ASSERT_TRUE(observer.Saw(::gatekeeper::PHASE_WRITE_FAILURE_RECORD));
+    ASSERT_TRUE(observer.Saw(::gatekeeper::PHASE_PASSWORD_SIGNATURE));
+    ASSERT_TRUE(observer.Saw(::gatekeeper::PHASE_MINT_AUTH_TOKEN));
+    ASSERT_TRUE(observer.Saw(::gatekeeper::PHASE_CLEAR_FAILURE_RECORD));
+
+    // every phase that begins also ends, innermost first
+    std::vector<int> open;
+    for (size_t i = 0; i < observer.events.size(); i++) {
+        int event = observer.events[i];
+        if (event >= 0) {
+            open.push_back(event);
+        } else {
+            ASSERT_FALSE(open.empty());
+            ASSERT_EQ(-1 - event, open.back());
+            open.pop_back();
+        }
+    }
+    ASSERT_TRUE(open.empty());
+}
+
+TEST(GateKeeperTest, ObserverVerifyAsync) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    gatekeeper.transactions = true;
+    gatekeeper.async_commit = true;
+
+    RecordingObserver observer;
+    gatekeeper.SetObserver(&observer);
+    VerifyRequest request;
+    make_verify_request(enroll_response.enrolled_password_handle, USER_ID, 0, "password",
+            &request);
+    VerifyResponse response;
+    ASSERT_FALSE(gatekeeper.VerifyAsync(request, &response));
+    ASSERT_EQ(::gatekeeper::PHASE_VERIFY, observer.events.front());
+    ASSERT_NE(-1 - ::gatekeeper::PHASE_VERIFY, observer.events.back());
+
+    // the phase spans the commit, up to the completed response
+    gatekeeper.CompleteVerifyAsync(true);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ(-1 - ::gatekeeper::PHASE_VERIFY, observer.events.back());
+}
+
+TEST(GateKeeperTest, Stats) {
+    FakeGateKeeper gatekeeper;
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    VerifyResponse response;
+    verify(&gatekeeper, handle, "password", &response);
+    // the fifth failure starts a lockout, the sixth attempt is throttled
+    for (int i = 0; i < 6; i++) {
+        VerifyResponse bad_response;
+        verify(&gatekeeper, handle, "wrong", &bad_response);
+    }
+
+    GetStatsRequest request(USER_ID);
+    GetStatsResponse stats_response;
+    gatekeeper.GetStats(request, &stats_response);
+    const ::gatekeeper::gatekeeper_stats_t &stats = stats_response.stats;
+    ASSERT_EQ((uint32_t) 1, stats.enroll_requests);
+    ASSERT_EQ((uint32_t) 7, stats.verify_requests);
+    ASSERT_EQ((uint32_t) 1, stats.verify_successes);
+    ASSERT_EQ((uint32_t) 5, stats.verify_failures);
+    ASSERT_EQ((uint32_t) 1, stats.retry_timeouts);
+    ASSERT_EQ((uint32_t) 1, stats.throttled);
+    ASSERT_EQ((uint32_t) 0, stats.reenroll_requested);
+}
+
+TEST(GateKeeperTest, ResponsesUseArena) {
+    FakeGateKeeper gatekeeper;
+    uint8_t memory[256];
+    ::gatekeeper::Arena arena(memory, sizeof(memory));
+
+    EnrollResponse enroll_response;
+    enroll_response.arena = &arena;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+    ASSERT_EQ(NULL, handle.buffer.get());
+    ASSERT_TRUE(handle.Data() >= memory && handle.Data() < memory + sizeof(memory));
+
+    VerifyResponse response;
+    response.arena = &arena;
+    verify(&gatekeeper, handle, "password", &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ(NULL, response.auth_token.buffer.get());
+    ASSERT_TRUE(response.auth_token.Data() >= memory
+            && response.auth_token.Data() < memory + sizeof(memory));
+}
+
+TEST(GateKeeperTest, AuthTokenKeyCache) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.EnableAuthTokenKeyCache();
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    VerifyResponse first;
+    verify(&gatekeeper, handle, "password", &first);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, first.error);
+    VerifyResponse second;
+    verify(&gatekeeper, handle, "password", &second);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, second.error);
+    ASSERT_EQ(1, gatekeeper.auth_token_key_fetches);
+    ASSERT_EQ(0, memcmp(first.auth_token.Data(), second.auth_token.Data(),
+            sizeof(hw_auth_token_t)));
+
+    // a changed key is only picked up once the implementor invalidates it
+    memset(gatekeeper.auth_token_key, 'b', sizeof(gatekeeper.auth_token_key));
+    VerifyResponse stale;
+    verify(&gatekeeper, handle, "password", &stale);
+    ASSERT_EQ(1, gatekeeper.auth_token_key_fetches);
+    ASSERT_EQ(0, memcmp(first.auth_token.Data(), stale.auth_token.Data(),
+            sizeof(hw_auth_token_t)));
+
+    gatekeeper.InvalidateAuthTokenKey();
+    VerifyResponse fresh;
+    verify(&gatekeeper, handle, "password", &fresh);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, fresh.error);
+    ASSERT_EQ(2, gatekeeper.auth_token_key_fetches);
+    ASSERT_NE(0, memcmp(first.auth_token.Data(), fresh.auth_token.Data(),
+            sizeof(hw_auth_token_t)));
+}
+
+/**
+ * Rotates the auth token key while GateKeeper is fetching it, as another
+ * thread could.
+ */
+class RotatingKeyGateKeeper : public FakeGateKeeper {
+public:
+    RotatingKeyGateKeeper() : rotate(false) {}
+
+    virtual bool GetAuthTokenKey(const uint8_t **key, uint32_t *length) const {
+        bool result = FakeGateKeeper::GetAuthTokenKey(key, length);
+        if (rotate) {
+            rotate = false;
+            RotatingKeyGateKeeper *self = const_cast<RotatingKeyGateKeeper *>(this);
+            memset(self->auth_token_key, 'c', sizeof(self->auth_token_key));
+            self->InvalidateAuthTokenKey();
+        }
+        return result;
+    }
+
+    mutable bool rotate;
+};
+
+TEST(GateKeeperTest, AuthTokenKeyInvalidatedDuringFetch) {
+    RotatingKeyGateKeeper gatekeeper;
+    gatekeeper.EnableAuthTokenKeyCache();
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    gatekeeper.rotate = true;
+    VerifyResponse first;
+    verify(&gatekeeper, handle, "password", &first);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, first.error);
+    ASSERT_EQ(1, gatekeeper.auth_token_key_fetches);
+
+    // the copy fetched before the rotation must not be reused
+    VerifyResponse second;
+    verify(&gatekeeper, handle, "password", &second);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, second.error);
+    ASSERT_EQ(2, gatekeeper.auth_token_key_fetches);
+    ASSERT_NE(0, memcmp(first.auth_token.Data(), second.auth_token.Data(),
+            sizeof(hw_auth_token_t)));
+}
+
+TEST(GateKeeperTest, AuthTokenKeyInvalidatedFromAnotherThread) {
+    FakeGateKeeper gatekeeper;
+    gatekeeper.EnableAuthTokenKeyCache();
+    EnrollResponse enroll_response;
+    enroll(&gatekeeper, "password", &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    std::thread invalidator([&gatekeeper] {
+        for (int i = 0; i < 100; i++) gatekeeper.InvalidateAuthTokenKey();
+    });
+    for (int i = 0; i < 20; i++) {
+        VerifyResponse response;
+        verify(&gatekeeper, handle, "password", &response);
+        EXPECT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    }
+    invalidator.join();
+}
+
+/**
+ * Statically dispatched platform using the same keys and signature scheme as
+ * FakeGateKeeper, so that handles can be checked against it.
+ */
+class StaticGateKeeper : public ::gatekeeper::GateKeeperT<StaticGateKeeper> {
+public:
+    StaticGateKeeper() : now(1000), seed(7) {
+        memset(password_key, 'p', sizeof(password_key));
+        memset(&record, 0, sizeof(record));
+    }
+
+    uint64_t now;
+    failure_record_t record;
+
+private:
+    friend class ::gatekeeper::GateKeeperT<StaticGateKeeper>;
+
+    bool GetAuthTokenKey(const uint8_t **key, uint32_t *length) const {
+        uint8_t *copy = new uint8_t[sizeof(password_key)];
+        memset(copy, 'a', sizeof(password_key));
+        *key = copy;
+        *length = sizeof(password_key);
+        return true;
+    }
+
+    void GetPasswordKey(const uint8_t **key, uint32_t *length) {
+        *key = password_key;
+        *length = sizeof(password_key);
+    }
+
+    void ComputePasswordSignature(uint8_t *signature, uint32_t signature_length,
+            const uint8_t *key, uint32_t key_length, const uint8_t *password,
+            uint32_t password_length, ::gatekeeper::salt_t salt) const {
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, key, key_length);
+        SHA256_Update(&ctx, &salt, sizeof(salt));
+        SHA256_Update(&ctx, password, password_length);
+        Finish(&ctx, signature, signature_length);
+    }
+
+    void ComputeSignature(uint8_t *signature, uint32_t signature_length, const uint8_t *key,
+            uint32_t key_length, const uint8_t *message, uint32_t length) const {
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, key, key_length);
+        SHA256_Update(&ctx, message, length);
+        Finish(&ctx, signature, signature_length);
+    }
+
+    void GetRandom(void *random, uint32_t requested_size) const {
+        uint8_t *out = static_cast<uint8_t *>(random);
+        for (uint32_t i = 0; i < requested_size; i++) out[i] = seed++;
+    }
+
+    uint64_t GetMillisecondsSinceBoot() const { return now; }
+
+    bool GetFailureRecord(uint32_t, ::gatekeeper::secure_id_t user_id,
+            failure_record_t *out, bool) {
+        if (record.secure_user_id != user_id) {
+            memset(&record, 0, sizeof(record));
+            record.secure_user_id = user_id;
+        }
+        *out = record;
+        return true;
+    }
+
+    bool ClearFailureRecord(uint32_t, ::gatekeeper::secure_id_t user_id, bool) {
+        memset(&record, 0, sizeof(record));
+        record.secure_user_id = user_id;
+        return true;
+    }
+
+    bool WriteFailureRecord(uint32_t, failure_record_t *in, bool) {
+        record = *in;
+        return true;
+    }
+
+    bool IsHardwareBacked() const { return false; }
+
+    static void Finish(SHA256_CTX *ctx, uint8_t *signature, uint32_t signature_length) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        SHA256_Final(digest, ctx);
+        memset(signature, 0, signature_length);
+        memcpy(signature, digest,
+                signature_length < sizeof(digest) ? signature_length : sizeof(digest));
+    }
+
+    mutable uint8_t seed;
+    uint8_t password_key[32];
+};
+
+TEST(GateKeeperTest, StaticPlatform) {
+    StaticGateKeeper gatekeeper;
+    UniquePtr<SizedBuffer> provided(make_password("password"));
+    EnrollRequest request(USER_ID, NULL, provided.get(), NULL);
+    EnrollResponse enroll_response;
+    gatekeeper.Enroll(request, &enroll_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.error);
+    const SizedBuffer &handle = enroll_response.enrolled_password_handle;
+
+    VerifyRequest verify_request;
+    make_verify_request(handle, USER_ID, 42, "password", &verify_request);
+    VerifyResponse response;
+    gatekeeper.Verify(verify_request, &response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, response.error);
+    ASSERT_EQ((uint64_t) 42,
+            reinterpret_cast<const hw_auth_token_t *>(response.auth_token.Data())->challenge);
+
+    VerifyRequest wrong_request;
+    make_verify_request(handle, USER_ID, 0, "wrong", &wrong_request);
+    VerifyResponse wrong;
+    gatekeeper.Verify(wrong_request, &wrong);
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, wrong.error);
+    ASSERT_EQ((uint32_t) 1, gatekeeper.record.failure_counter);
+
+    // handles are interchangeable with the virtual GateKeeper
+    FakeGateKeeper fake;
+    VerifyResponse fake_response;
+    verify(&fake, handle, "password", &fake_response);
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, fake_response.error);
+}
+
+TEST(GateKeeperTest, HandleMessage) {
+    FakeGateKeeper gatekeeper;
+    UniquePtr<SizedBuffer> provided(make_password("password"));
+    EnrollRequest enroll_request(USER_ID, NULL, provided.get(), NULL);
+    SizedBuffer in(enroll_request.GetSerializedSize());
+    enroll_request.Serialize(in.buffer.get(), in.buffer.get() + in.length);
+
+    uint8_t out[256];
+    uint32_t size = gatekeeper.HandleMessage(::gatekeeper::ENROLL, in.buffer.get(), in.length,
+            out, sizeof(out));
+    ASSERT_LE(size, sizeof(out));
+    EnrollResponse enroll_response;
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, enroll_response.Deserialize(out, out + size));
+    ASSERT_EQ(USER_ID, enroll_response.user_id);
+    ASSERT_EQ(::gatekeeper::HANDLE_LENGTH_MIN, enroll_response.enrolled_password_handle.length);
+
+    VerifyRequest verify_request;
+    make_verify_request(enroll_response.enrolled_password_handle, USER_ID, 42, "password",
+            &verify_request);
+    SizedBuffer verify_in(verify_request.GetSerializedSize());
+    verify_request.Serialize(verify_in.buffer.get(), verify_in.buffer.get() + verify_in.length);
+
+    // too small: the request still runs, but only the required size is returned
+    uint32_t required = gatekeeper.HandleMessage(::gatekeeper::VERIFY, verify_in.buffer.get(),
+            verify_in.length, out, 4);
+    ASSERT_GT(required, (uint32_t) 4);
+
+    size = gatekeeper.HandleMessage(::gatekeeper::VERIFY, verify_in.buffer.get(),
+            verify_in.length, out, sizeof(out));
+    ASSERT_EQ(required, size);
+    VerifyResponse verify_response;
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, verify_response.Deserialize(out, out + size));
+    ASSERT_EQ(sizeof(hw_auth_token_t), verify_response.auth_token.length);
+    ASSERT_EQ((uint64_t) 42,
+            reinterpret_cast<const hw_auth_token_t *>(verify_response.auth_token.Data())
+                    ->challenge);
+
+    // malformed input is answered with an error response
+    size = gatekeeper.HandleMessage(::gatekeeper::VERIFY, verify_in.buffer.get(), 3, out,
+            sizeof(out));
+    VerifyResponse invalid;
+    ASSERT_EQ(::gatekeeper::ERROR_INVALID, invalid.Deserialize(out, out + size));
+    ASSERT_EQ((uint32_t) 0, gatekeeper.HandleMessage(~0u, in.buffer.get(), in.length, out,
+            sizeof(out)));
+
+    GetStatsRequest stats_request(USER_ID);
+    SizedBuffer stats_in(stats_request.GetSerializedSize());
+    stats_request.Serialize(stats_in.buffer.get(), stats_in.buffer.get() + stats_in.length);
+    size = gatekeeper.HandleMessage(::gatekeeper::GET_STATS, stats_in.buffer.get(),
+            stats_in.length, out, sizeof(out));
+    GetStatsResponse stats;
+    ASSERT_EQ(::gatekeeper::ERROR_NONE, stats.Deserialize(out, out + size));
+    ASSERT_EQ((uint32_t) 2, stats.stats.verify_successes);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gatekeeper/gatekeeper_utils.h>
+
+using ::gatekeeper::memcmp_s;
+using ::gatekeeper::memset_s;
+
+static void fill(uint8_t *buffer, size_t length, unsigned seed) {
+    srand(seed);
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = rand();
+    }
+}
+
+TEST(MemcmpSTest, EveryLengthAndAlignment) {
+    uint8_t a[80 + 8], b[80 + 8];
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t length = 0; length <= 80; length++) {
+            fill(a + offset, length, length);
+            memcpy(b + 1, a + offset, length);
+            ASSERT_EQ(0, memcmp_s(a + offset, b + 1, length)) << offset << " " << length;
+
+            // a difference anywhere, in any bit, is found
+            for (size_t i = 0; i < length; i++) {
+                uint8_t bit = 1 << (i % 8);
+                b[1 + i] ^= bit;
+                ASSERT_EQ(1, memcmp_s(a + offset, b + 1, length)) << offset << " " << i;
+                b[1 + i] ^= bit;
+            }
+        }
+    }
+}
+
+TEST(MemsetSTest, Wipes) {
+    uint8_t buffer[67];
+    fill(buffer, sizeof(buffer), 1);
+    ASSERT_EQ(buffer, memset_s(buffer, 0, sizeof(buffer)));
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        ASSERT_EQ(0, buffer[i]);
+    }
+    ASSERT_EQ(NULL, memset_s(NULL, 0, sizeof(buffer)));
+}